@@ -118,12 +118,6 @@ enum rpu_testmode_cmd {
 #endif
 extern unsigned int system_rev;
 
-#ifdef PERF_PROFILING
-extern unsigned long irq_timestamp[20];
-extern unsigned int irq_ts_index;
-extern spinlock_t timing_lock;
-#endif
-
 extern struct platform_driver img_uccp_driver;
 extern unsigned char vif_macs[2][ETH_ALEN];
 
@@ -169,6 +163,22 @@ extern spinlock_t tsf_lock;
 #define SUPPORTED_FILTERS (FIF_ALLMULTI | FIF_BCN_PRBRESP_PROMISC)
 #define TX_DESC_BUCKET_BOUND 32
 
+/* Bytes a peer may send per round when several peers have frames pending
+ * on an AC
+ */
+#define TX_DRR_QUANTUM (4 * MAX_AMPDU_SUBFRAME_SIZE)
+
+/* Same, in us of airtime, with airtime_fair set */
+#define TX_AIRTIME_QUANTUM 500
+
+/* Iterations allowed for the tx_token_bench proc command */
+#define TX_TOKEN_BENCH_MAX 1000000
+
+/* Two TIDs map to each AC, each peer has a pending queue per TID so that
+ * an aggregate is never cut short by a frame of the other TID
+ */
+#define TX_TIDS_PER_AC 2
+
 #define MAX_DATA_SIZE (0) /* Defined in HAL (or) can be configured from proc */
 #define MAX_TX_QUEUE_LEN 192
 #define MAX_AUX_ADC_SAMPLES 10
@@ -243,6 +253,7 @@ struct wifi_params {
 	unsigned char rate_protection_type;
 	unsigned char num_spatial_streams;
 	unsigned char enable_early_agg_checks;
+	unsigned char airtime_fair;
 	unsigned char uccp_num_spatial_streams;
 	unsigned char auto_sensitivity;
 	/*RF Params: Input to the RF for operation*/
@@ -360,6 +371,12 @@ struct wifi_stats {
 	unsigned int gen_cmd_send_count;
 	unsigned int tx_cmd_send_count_single;
 	unsigned int tx_cmd_send_count_multi;
+	unsigned long long tx_ampdu_build_cycles;
+	unsigned int tx_ampdu_builds;
+	unsigned int tx_descs_sent;
+	unsigned long long tx_desc_frames;
+	unsigned int tx_txq_wakes;
+	unsigned int tx_txq_pulled;
 
 	unsigned int tx_noagg_not_qos;
 	unsigned int tx_noagg_not_ampdu;
@@ -530,6 +547,8 @@ struct tx_pkt_info {
 	int roc_peer_id;
 	int peer_id;
 	bool adjusted_rates;
+	/* Airtime in us charged to the peer when the descriptor was built */
+	unsigned int airtime_est;
 };
 
 
@@ -543,19 +562,41 @@ struct tx_config {
 	/* Used to store tx tokens(buff pool ids) */
 	unsigned long buf_pool_bmp[(NUM_TX_DESCS/TX_DESC_BUCKET_BOUND) + 1];
 
+	/* Reserved tokens of each AC and the spare tokens, as masks over
+	 * buf_pool_bmp[0]
+	 */
+	unsigned long ac_token_mask[NUM_ACS];
+	unsigned long spare_token_mask;
+
 	unsigned int outstanding_tokens[NUM_ACS];
-	unsigned int next_spare_token_ac;
+
+	/* Peers with frames pending, per AC, and their deficit in bytes for
+	 * the round robin between them
+	 */
+	unsigned long pend_q_active[NUM_ACS];
+	int deficit[MAX_PEND_Q_PER_AC][NUM_ACS];
+
+	/* Airtime used per peer in us, all ACs, estimated at TX done, and
+	 * the bytes acked in that time
+	 */
+	unsigned long long airtime[MAX_PEND_Q_PER_AC];
+	unsigned long long tx_bytes[MAX_PEND_Q_PER_AC];
 
 	/* Used to store the address of pending skbs per ac */
 #ifdef MULTI_CHAN_SUPPORT
 	struct sk_buff_head pending_pkt[MAX_UMAC_VIF_CHANCTX_TYPES]
 				       [MAX_PEND_Q_PER_AC]
-				       [NUM_ACS];
+				       [NUM_ACS]
+				       [TX_TIDS_PER_AC];
 #else
 	struct sk_buff_head pending_pkt[MAX_PEND_Q_PER_AC]
-				       [NUM_ACS];
+				       [NUM_ACS]
+				       [TX_TIDS_PER_AC];
 #endif
 
+	/* TID queue of each peer last used to fill a descriptor */
+	unsigned char curr_tid[MAX_PEND_Q_PER_AC][NUM_ACS];
+
 #ifdef MULTI_CHAN_SUPPORT
 	/* Peer which has the opportunity to xmit next on a queue */
 	unsigned int curr_peer_opp[MAX_CHANCTX + MAX_OFF_CHANCTX][NUM_ACS];
@@ -576,6 +617,10 @@ struct tx_config {
 
 	unsigned int queue_stopped_bmp;
 	struct sk_buff_head proc_tx_list[NUM_TX_DESCS];
+
+	/* mac80211 TXQs with frames to pull, per AC */
+	spinlock_t txq_lock;
+	struct list_head txq_active[NUM_ACS];
 };
 
 enum device_state {
@@ -720,6 +765,17 @@ struct umac_vif {
 #endif
 };
 
+/* Frames pulled from a TXQ are held in the pending queue of the peer only
+ * up to this many times the aggregation size, the rest stay in mac80211
+ */
+#define TXQ_PEND_DEPTH 2
+
+struct umac_txq {
+	struct list_head list;
+	struct ieee80211_txq *txq;
+	bool active;
+};
+
 struct umac_sta {
 	int index;
 	int vif_index;
@@ -741,8 +797,21 @@ struct umac_chanctx {
 struct curr_peer_info {
 	int id;
 	int op_chan_idx;
+	int tid;
 };
 
+/* Frames pending for a peer on an AC, all TIDs */
+static inline unsigned int tx_pend_q_len(struct sk_buff_head *tid_q)
+{
+	unsigned int len = 0;
+	int i;
+
+	for (i = 0; i < TX_TIDS_PER_AC; i++)
+		len += skb_queue_len(&tid_q[i]);
+
+	return len;
+}
+
 
 #ifdef MULTI_CHAN_SUPPORT
 void uccp420wlan_proc_ch_sw_event(struct umac_event_ch_switch *ch_sw_info,
@@ -784,6 +853,13 @@ extern int __uccp420wlan_tx_frame(struct mac80211_dev *dev,
 				  bool retry);
 extern void uccp420wlan_tx_init(struct mac80211_dev *dev);
 extern void uccp420wlan_tx_deinit(struct mac80211_dev *dev);
+extern void uccp420wlan_tx_token_bench(struct mac80211_dev *dev,
+				       unsigned int iterations);
+extern unsigned int uccp420wlan_txq_pend_len(struct mac80211_dev *dev,
+					     struct ieee80211_txq *txq,
+					     int peer_id,
+					     int ac);
+extern void uccp420wlan_txq_pull(struct mac80211_dev *dev, int ac);
 void uccp420wlan_tx_proc_send_pend_frms_all(struct mac80211_dev *dev,
 					   int chan_id);
 extern void proc_bss_info_changed(unsigned char *mac_addr, int value);
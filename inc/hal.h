@@ -60,6 +60,27 @@
 #define HAL_AXD_DATA_START ((hpriv->gram_mem_addr) + HAL_AXD_DATA_OFFSET)
 
 #define HAL_GRAM_CMD_LEN (HAL_GRAM_CMD_START + 8)
+
+/* Event ring negotiation, uses the unused words of the event slot. The
+ * host posts magic | entries in REQ, a FW supporting the ring answers with
+ * the ring offset from the GRAM base in RSP and the granted entries in
+ * RSP_ENTRIES. Only requested when the FW sets UMAC_CAP_EVENT_RING in
+ * the reset complete event, other FW stays on the single slot.
+ */
+#define HAL_GRAM_EVENT_RING_REQ (HAL_GRAM_EVENT_START + 12)
+#define HAL_GRAM_EVENT_RING_RSP (HAL_GRAM_EVENT_START + 16)
+#define HAL_GRAM_EVENT_RING_RSP_ENTRIES (HAL_GRAM_EVENT_START + 20)
+#define HAL_EVENT_RING_MAGIC 0x45560000
+#define HAL_EVENT_RING_MAX_ENTRIES 64
+
+/* Command ring negotiation, same handshake as the event ring, gated on
+ * UMAC_CAP_CMD_RING
+ */
+#define HAL_GRAM_CMD_RING_REQ (HAL_GRAM_EVENT_START + 24)
+#define HAL_GRAM_CMD_RING_RSP (HAL_GRAM_EVENT_START + 28)
+#define HAL_GRAM_CMD_RING_RSP_ENTRIES (HAL_GRAM_EVENT_START + 32)
+#define HAL_CMD_RING_MAGIC 0x434d0000
+#define HAL_CMD_RING_MAX_ENTRIES 32
 #define HAL_GRAM_TX_DATA_LEN (HAL_GRAM_TX_DATA_START + 0)
 #define HAL_GRAM_TX_DATA_OFFSET	(HAL_GRAM_TX_DATA_START + 3)
 #define HAL_GRAM_TX_DATA_ADDR (HAL_GRAM_TX_DATA_START + 6)
@@ -85,6 +106,7 @@ struct buf_info {
 	void __iomem *src_ptr;
 	unsigned int dma_buf_len;
 	unsigned int dma_buf_priv;   /* Is the DMA buffer in our private area */
+	unsigned int dma_buf_page;   /* Mapped with dma_map_page */
 	struct sk_buff *skb;
 } _PACKED_;
 
@@ -134,12 +156,29 @@ void _uccp420wlan_80211if_exit(void);
 int reset_hal_params(void);
 typedef int (*msg_handler)(void *, unsigned char);
 
+/* RX filter, called with the LMAC message in the RX buffer or the GRAM
+ * event slot before an skb is taken for it. On HAL_RX_DROP the message
+ * was consumed and the buffer or slot goes straight back to the FW.
+ */
+enum hal_rx_verdict {
+	HAL_RX_PASS = 0,
+	HAL_RX_DROP,
+};
+
+typedef int (*rx_filter_handler)(void *, unsigned int);
+
 struct hal_ops_tag {
 	int (*init)(void *);
 	int (*deinit)(void *);
 	int (*start)(void);
 	int (*stop)(void);
 	void (*register_callback)(msg_handler, unsigned char);
+	void (*register_rx_filter)(rx_filter_handler);
+	void (*request_rings)(int, int);
+	void *(*get_cmd_buf)(unsigned int);
+	void (*free_cmd_buf)(void *);
+	int (*map_tx_desc)(int, void *);
+	void (*unmap_tx_desc)(int, int);
 	void (*send)(void*, unsigned char, unsigned char, void*);
 	int (*init_bufs)(unsigned int, unsigned int, unsigned int,
 			 unsigned int);
@@ -161,6 +200,7 @@ struct hal_ops_tag {
 	int (*get_dump_len)(unsigned long);
 	int (*update_axd_timestamps)(void);
 	unsigned int (*get_axd_buf_phy_addr)(void);
+	struct napi_struct *(*get_rx_napi)(void);
 };
 
 extern struct hal_ops_tag hal_ops;
@@ -25,7 +25,12 @@
 #ifndef _UCCP420WLAN_HAL_HOSTPORT_H_
 #define _UCCP420WLAN_HAL_HOSTPORT_H_
 
+#include <linux/hrtimer.h>
+#include <linux/cpumask.h>
 #include <linux/interrupt.h>
+#include <linux/mutex.h>
+#include <linux/netdevice.h>
+#include <linux/scatterlist.h>
 #include <linux/skbuff.h>
 
 #include <hal.h>
@@ -35,6 +40,94 @@ extern "C"
 {
 #endif /* __cplusplus */
 
+#define HAL_EVENT_RING_SIZE 64 /* Power of 2 */
+
+/* Command buffers, sized for a cmd_tx_ctrl with the headers of a full
+ * descriptor. Larger commands are allocated.
+ */
+#define HAL_CMD_POOL_SIZE 32
+#define HAL_CMD_BUF_SIZE (sizeof(struct cmd_tx_ctrl) + \
+			  NUM_FRAMES_IN_TX_DESC * MAX_GRAM_PAYLOAD_LEN)
+
+/* Event slot contents latched in the IRQ, translated to host addresses */
+struct hal_event_desc {
+	unsigned long addr;
+	unsigned long status_addr;
+	unsigned long len;
+};
+
+/* Event ring in GRAM, written by the FW at head and consumed by the host
+ * at tail. Addresses are in the UCCP view, as in the single event slot.
+ */
+struct hal_gram_event_ring {
+	unsigned int head;
+	unsigned int tail;
+	struct {
+		unsigned int addr;
+		unsigned int status_addr;
+		unsigned int len;
+	} _PACKED_ entry[0];
+} _PACKED_;
+
+/* Datapath latency histograms, bucket n counts values below 2^n */
+enum hal_hist_id {
+	HAL_HIST_IRQ,		/* IRQ handler duration, ns */
+	HAL_HIST_IRQ_TO_BH,	/* IRQ to bottom half start, ns */
+	HAL_HIST_RX_EVENT,	/* RX event handling, ns */
+	HAL_HIST_RX_PKT_CNT,	/* rx_pkt_cnt per RX event */
+	HAL_HIST_CMD_WAIT,	/* Command slot busy to free, ns */
+	HAL_HIST_CMD_BATCH,	/* Commands per doorbell */
+	HAL_HIST_TX_MAP,	/* DMA map of a TX descriptor, ns */
+	HAL_HIST_TX_UNMAP,	/* DMA unmap of a TX descriptor, ns */
+	HAL_HIST_CMD_POST,	/* Command copy to GRAM up to doorbell, ns */
+	HAL_HIST_MAX
+};
+
+#define HAL_HIST_BUCKETS 32
+
+struct hal_hist {
+	unsigned int cnt[HAL_HIST_BUCKETS];
+	u64 max;
+};
+
+/* Command ring in GRAM, the host posts at head and rings the doorbell, the
+ * FW consumes at tail. The FW sets up the buffer address and size of each
+ * entry, the host writes the command and its length.
+ */
+struct hal_gram_cmd_ring {
+	unsigned int head;
+	unsigned int tail;
+	struct {
+		unsigned int addr;
+		unsigned int max_len;
+		unsigned int len;
+	} _PACKED_ entry[0];
+} _PACKED_;
+
+#define HAL_RX_HIST_BINS 8 /* < 256B, doubling up to >= 16K */
+#define HAL_RX_POOL_ADAPT_FRAMES 4096
+#define HAL_RX_POOL_ADAPT_STEP 8
+#define HAL_RX_POOL_PROBE 4
+
+/* Recycling pool of RX pages that lie inside the RPU 64MB window */
+struct hal_rx_pool {
+	struct page **pages;
+	/* Pages handed out at least once since they joined the pool */
+	unsigned long *used;
+	unsigned int num_pages;
+	unsigned int target_pages;
+	unsigned int max_pages;
+	unsigned int order;
+	unsigned int next;
+};
+
+/* Pool skbs taken in one go for the descriptors of an RX event */
+struct hal_rx_bulk {
+	struct sk_buff *skb[MAX_RX_BUF_PTR_PER_CMD];
+	unsigned int cnt;
+	unsigned int next;
+};
+
 struct hal_priv {
 	/* UCCP Host RAM mappings*/
 	void __iomem *base_addr_uccp_host_ram;
@@ -51,6 +144,14 @@ struct hal_priv {
 	unsigned long hal_disabled;
 	unsigned long gram_b4_addr;
 
+	/* Write-combined mapping of the GRAM bulk area, from the TX data
+	 * on, used for the command and TX data copies only. gram_wc_start
+	 * is the same address in the uncached mapping.
+	 */
+	unsigned long gram_wc_base_addr;
+	unsigned long gram_wc_start;
+	unsigned long gram_wc_len;
+
 	/* DTS entries */
 	unsigned long uccp_sysbus_base;
 	unsigned long uccp_sysbus_len;
@@ -65,15 +166,99 @@ struct hal_priv {
 	struct sk_buff_head txq;
 	struct tasklet_struct tx_tasklet;
 	unsigned short cmd_cnt;
+
+	/* Preallocated command buffers, bit set in cmd_pool_busy while in
+	 * use
+	 */
+	struct sk_buff *cmd_pool[HAL_CMD_POOL_SIZE];
+	unsigned int cmd_pool_next;
+	unsigned long cmd_pool_busy;
+	unsigned int cmd_pool_hits;
+	unsigned int cmd_pool_miss;
+
+	/* Command slot wait: start of the wait (0 if the slot is not
+	 * awaited), poll timer and its current backoff, and the waits,
+	 * timeouts and time spent spinning so far
+	 */
+	u64 cmd_wait_start;
+	struct hrtimer cmd_timer;
+	unsigned int cmd_backoff_us;
+	unsigned int cmd_slot_waits;
+	unsigned int cmd_timeouts;
+	u64 cmd_spin_ns;
+
+	/* Commands put back on txq for a later try, the FW did not take
+	 * them or gave an invalid slot
+	 */
+	unsigned int cmd_retries;
+
+	/* Negotiated command ring in GRAM, NULL while in single slot mode.
+	 * cmd_ring_rung is the head at the last doorbell, cmd_ring_pending
+	 * the number of entries asked for while the answer is awaited.
+	 */
+	struct hal_gram_cmd_ring __iomem *gram_cmd_ring;
+	unsigned int cmd_ring_entries;
+	unsigned int cmd_ring_head;
+	unsigned int cmd_ring_rung;
+	unsigned int cmd_ring_pending;
+	unsigned int cmd_doorbells;
 	struct buf_info *tx_buf_info;
+
+	/* TX frames copied to the bounce buffer, not DMA-able in place */
+	unsigned int tx_bounce;
 	struct hal_tx_data *hal_tx_data;
 
-	/* RX */
-	struct sk_buff_head rxq;
+	/* Copy of the TX data entries as last written to GRAM, the writes
+	 * done, their bytes and the writes skipped as nothing changed
+	 */
+	struct hal_tx_data *hal_tx_data_gram;
+	unsigned int tx_data_writes;
+	unsigned long tx_data_bytes;
+	unsigned int tx_data_skipped;
+
+	/* TX entries used per descriptor, and the entry and number of
+	 * entries mapped (0 or 1) of each frame
+	 */
+	unsigned char tx_slots_used[NUM_TX_DESC];
+	unsigned char tx_frame_slot[NUM_TX_DESC][NUM_FRAMES_IN_TX_DESC];
+	unsigned char tx_frame_nslots[NUM_TX_DESC][NUM_FRAMES_IN_TX_DESC];
+
+	/* Scatterlist of each descriptor when mapped in one go, and the TX
+	 * entry of each of its elements
+	 */
+	struct scatterlist tx_sgl[NUM_TX_DESC][NUM_FRAMES_IN_TX_DESC];
+	unsigned char tx_sgl_slot[NUM_TX_DESC][NUM_FRAMES_IN_TX_DESC];
+	unsigned int tx_sgl_nents[NUM_TX_DESC];
+
+	/* RX: events are posted to the ring by the IRQ (or NAPI poll) and
+	 * consumed by the bottom half, skbs for LMAC events come from the
+	 * slab.
+	 */
+	struct hal_event_desc event_ring[HAL_EVENT_RING_SIZE];
+	unsigned int event_head;
+	unsigned int event_tail;
+	unsigned int event_ring_full;
+	unsigned int event_skb_allocs;
+	unsigned int event_inplace;
 	struct tasklet_struct rx_tasklet;
 	struct tasklet_struct recv_tasklet;
 	unsigned short event_cnt;
+
+	/* Negotiated event ring in GRAM, NULL while in single slot mode.
+	 * gram_ring_pending is the number of entries asked for while the
+	 * answer is awaited.
+	 */
+	struct hal_gram_event_ring __iomem *gram_event_ring;
+	unsigned int gram_ring_entries;
+	unsigned int gram_ring_tail;
+	unsigned int gram_ring_pending;
+
+	/* Events taken by the fetches, in total and at most in one go */
+	unsigned int events_fetched;
+	unsigned int events_fetch_max;
 	msg_handler rcv_handler;
+	rx_filter_handler rx_filter;
+	unsigned int rx_filter_drops;
 	struct buf_info *rx_buf_info;
 
 	/* Buffers info from IF layer*/
@@ -82,9 +267,79 @@ struct hal_priv {
 	unsigned int rx_bufs_12k;
 	unsigned int max_data_size;
 
+	/* Window backed RX buffers, avoids the copy from the private area */
+	struct hal_rx_pool rx_pool_2k;
+	struct hal_rx_pool rx_pool_12k;
+	struct hal_rx_bulk rx_bulk_2k;
+	struct hal_rx_bulk rx_bulk_12k;
+	unsigned int rx_zero_copy;
+	unsigned int rx_copy;
+	unsigned int rx_pool_recycled;
+	unsigned int rx_pool_miss;
+
+	/* RX frame sizes, drive the split of the pool budget */
+	unsigned int rx_len_hist[HAL_RX_HIST_BINS];
+	unsigned int rx_adapt_frames_2k;
+	unsigned int rx_adapt_frames_12k;
+	u64 rx_adapt_bytes_2k;
+	u64 rx_adapt_bytes_12k;
+
+	/* RX buffers batched for the next refill commands, enough batches
+	 * to hold every RX descriptor, and the number of buffers currently
+	 * owned by the FW
+	 */
+	struct cmd_hal *refill_cmds;
+	unsigned int refill_cmds_max;
+	unsigned int refill_cmds_used;
+	unsigned int rx_bufs_fw;
+	unsigned int rx_bufs_12k_fw;
+	unsigned int rx_refill_cmds;
+	unsigned int rx_refill_bufs;
+
 	/* Temp storage to refill first and process next*/
 	struct sk_buff_head refillq;
 	int irq;
+
+	/* NAPI based RX, used instead of rx/recv tasklets if rx_napi is set */
+	unsigned int rx_napi;
+	unsigned int irq_masked;
+	struct net_device napi_dev;
+	struct napi_struct napi;
+	struct napi_struct *napi_ctx;
+	unsigned int rx_napi_polls;
+	unsigned int rx_napi_budget_exhausted;
+
+	/* Interrupt moderation: events handled since the irq was masked,
+	 * their average and the holdoff timer
+	 */
+	unsigned int irq_events;
+	unsigned int irq_events_avg;
+	struct hrtimer irq_timer;
+
+	/* Set at teardown, the holdoff timer is not armed any more */
+	unsigned int irq_stopping;
+
+	/* Time of the last interrupt that scheduled the bottom half, ns */
+	u32 irq_ts;
+	unsigned int irq_count;
+	unsigned int irq_holdoffs;
+	unsigned long rx_data_bytes;
+
+	/* Per second rates, updated by rate_timer */
+	struct timer_list rate_timer;
+	unsigned int irq_per_sec;
+	unsigned int events_per_sec;
+	unsigned int rx_frames_per_sec;
+	unsigned int rx_kbps;
+	unsigned int tx_bounce_per_sec;
+
+	/* Dedicated RX thread, used instead of NAPI if rx_thread is set */
+	unsigned int rx_thread;
+	unsigned int rx_thread_prio;
+	struct cpumask rx_thread_cpus;
+	struct task_struct *rx_task;
+	unsigned long rx_thread_kick;
+	struct mutex rx_thread_lock;
 };
 
 
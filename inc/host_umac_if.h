@@ -1098,6 +1098,10 @@ struct host_event_disconnect {
 	unsigned char mac_addr[ETH_ALEN];
 } __packed;
 
+/* FW takes the event and command ring requests in the event slot */
+#define UMAC_CAP_EVENT_RING (1 << 30)
+#define UMAC_CAP_CMD_RING (1 << 31)
+
 struct host_event_reset_complete {
 	struct host_mac_msg_hdr hdr;
 	unsigned int cap;
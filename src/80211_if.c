@@ -541,6 +541,128 @@ tx_status:
 	ieee80211_tx_status(hw, skb);
 }
 
+static void txq_unlink(struct mac80211_dev *dev, struct ieee80211_txq *txq)
+{
+	struct umac_txq *utxq = (struct umac_txq *)txq->drv_priv;
+
+	spin_lock_bh(&dev->tx.txq_lock);
+	if (utxq->active) {
+		list_del_init(&utxq->list);
+		utxq->active = false;
+	}
+	spin_unlock_bh(&dev->tx.txq_lock);
+}
+
+
+/* Pull frames of an AC from the active TXQs, round robin, each TXQ only
+ * until the pending queue its frames go to is TXQ_PEND_DEPTH aggregates
+ * deep. The frames then take the same path as the ones pushed through
+ * tx().
+ */
+void uccp420wlan_txq_pull(struct mac80211_dev *dev, int ac)
+{
+	struct tx_config *tx = &dev->tx;
+	struct ieee80211_tx_control control;
+	struct ieee80211_txq *txq;
+	struct umac_txq *utxq;
+	struct umac_vif *uvif;
+	struct sk_buff *skb;
+	struct sk_buff_head frames;
+	LIST_HEAD(round);
+	bool empty;
+	int peer_id;
+	int room;
+
+	if (dev->state != STARTED)
+		return;
+
+	__skb_queue_head_init(&frames);
+
+	rcu_read_lock();
+	spin_lock_bh(&tx->txq_lock);
+	list_splice_init(&tx->txq_active[ac], &round);
+
+	while (!list_empty(&round)) {
+		utxq = list_first_entry(&round, struct umac_txq, list);
+		txq = utxq->txq;
+
+		if (txq->sta) {
+			peer_id = ((struct umac_sta *)txq->sta->drv_priv)->index;
+		} else {
+			uvif = (struct umac_vif *)txq->vif->drv_priv;
+			peer_id = MAX_PEERS + uvif->vif_index;
+		}
+
+		/* The station is being removed (sta_remove set its index to
+		 * -1), its frames are left to the mac80211 purge
+		 */
+		if (peer_id < 0) {
+			list_del_init(&utxq->list);
+			utxq->active = false;
+			continue;
+		}
+
+		empty = false;
+		room = TXQ_PEND_DEPTH * dev->params->max_tx_cmds -
+		       uccp420wlan_txq_pend_len(dev, txq, peer_id, ac);
+
+		while (room-- > 0) {
+			skb = ieee80211_tx_dequeue(dev->hw, txq);
+			if (!skb) {
+				empty = true;
+				break;
+			}
+			__skb_queue_tail(&frames, skb);
+		}
+
+		/* Idled under txq_lock, so the next wake finds it idle */
+		if (empty) {
+			list_del_init(&utxq->list);
+			utxq->active = false;
+		} else {
+			list_move_tail(&utxq->list, &tx->txq_active[ac]);
+		}
+
+		if (skb_queue_empty(&frames))
+			continue;
+
+		control.sta = txq->sta;
+		spin_unlock_bh(&tx->txq_lock);
+
+		while ((skb = __skb_dequeue(&frames)) != NULL) {
+			dev->stats->tx_txq_pulled++;
+			tx(dev->hw, &control, skb);
+		}
+
+		spin_lock_bh(&tx->txq_lock);
+	}
+
+	spin_unlock_bh(&tx->txq_lock);
+	rcu_read_unlock();
+}
+
+
+static void wake_tx_queue(struct ieee80211_hw *hw,
+			  struct ieee80211_txq *txq)
+{
+	struct mac80211_dev *dev = hw->priv;
+	struct umac_txq *utxq = (struct umac_txq *)txq->drv_priv;
+	int ac = tx_queue_map(txq->ac);
+
+	dev->stats->tx_txq_wakes++;
+
+	spin_lock_bh(&dev->tx.txq_lock);
+	if (!utxq->active) {
+		utxq->txq = txq;
+		utxq->active = true;
+		list_add_tail(&utxq->list, &dev->tx.txq_active[ac]);
+	}
+	spin_unlock_bh(&dev->tx.txq_lock);
+
+	uccp420wlan_txq_pull(dev, ac);
+}
+
+
 static int start(struct ieee80211_hw *hw)
 {
 	struct mac80211_dev *dev = (struct mac80211_dev *)hw->priv;
@@ -662,6 +784,9 @@ static void remove_interface(struct ieee80211_hw *hw,
 	v = vif;
 	vif_index = ((struct umac_vif *)&v->drv_priv)->vif_index;
 
+	if (v->txq)
+		txq_unlink(dev, v->txq);
+
 	uccp420wlan_vif_remove((struct umac_vif *)&v->drv_priv);
 	dev->active_vifs &= ~(1 << vif_index);
 	rcu_assign_pointer(dev->vifs[vif_index], NULL);
@@ -1414,6 +1539,7 @@ static void init_hw(struct ieee80211_hw *hw)
 	hw->extra_tx_headroom = 0;
 	hw->vif_data_size = sizeof(struct umac_vif);
 	hw->sta_data_size = sizeof(struct umac_sta);
+	hw->txq_data_size = sizeof(struct umac_txq);
 #ifdef MULTI_CHAN_SUPPORT
 	hw->chanctx_data_size = sizeof(struct umac_chanctx);
 #endif
@@ -2127,6 +2253,11 @@ int sta_add(struct ieee80211_hw *hw,
 		rcu_assign_pointer(dev->peers[peer_id], sta);
 		synchronize_rcu();
 
+		spin_lock_bh(&dev->tx.lock);
+		dev->tx.airtime[peer_id] = 0;
+		dev->tx.tx_bytes[peer_id] = 0;
+		spin_unlock_bh(&dev->tx.lock);
+
 		usta->index = peer_id;
 #ifdef MULTI_CHAN_SUPPORT
 		usta->chanctx = uvif->chanctx;
@@ -2154,6 +2285,10 @@ int sta_remove(struct ieee80211_hw *hw,
 	for (i = 0; i < ETH_ALEN; i++)
 		peer_st_info.addr[i] = sta->addr[i];
 
+	for (i = 0; i < ARRAY_SIZE(sta->txq); i++)
+		if (sta->txq[i])
+			txq_unlink(dev, sta->txq[i]);
+
 	/*purge the queues*/
 
 	for (i = 0; i < NUM_ACS; i++)
@@ -2776,6 +2911,7 @@ out:
 
 static struct ieee80211_ops ops = {
 	.tx                 = tx,
+	.wake_tx_queue      = wake_tx_queue,
 	.start              = start,
 	.stop               = stop,
 	.add_interface      = add_interface,
@@ -2854,6 +2990,10 @@ static int uccp420wlan_init(void)
 	dev = (struct mac80211_dev *)hw->priv;
 	memset(dev, 0, sizeof(struct mac80211_dev));
 
+	spin_lock_init(&dev->tx.txq_lock);
+	for (i = 0; i < NUM_ACS; i++)
+		INIT_LIST_HEAD(&dev->tx.txq_active[i]);
+
 	hwsim_class = class_create(THIS_MODULE, "uccp420");
 
 	if (IS_ERR(hwsim_class)) {
@@ -3017,6 +3157,8 @@ static int proc_read_config(struct seq_file *m, void *v)
 		   wifi->params.uccp_num_spatial_streams);
 	seq_printf(m, "enable_early_agg_checks = %d\n",
 		   wifi->params.enable_early_agg_checks);
+	seq_printf(m, "airtime_fair = %d\n",
+		   wifi->params.airtime_fair);
 	seq_printf(m, "antenna_sel (UCCP Init) = %d\n",
 		   wifi->params.antenna_sel);
 	seq_printf(m, "max_data_size = %d (%dK)\n",
@@ -3574,6 +3716,17 @@ static int proc_read_mac_stats(struct seq_file *m, void *v)
 		   wifi->stats.tx_cmd_send_count_single);
 	seq_printf(m, "tx_cmd_send_count_multi = %d\n",
 		   wifi->stats.tx_cmd_send_count_multi);
+	seq_printf(m, "tx_ampdu_build_cycles_avg = %llu\n",
+		   wifi->stats.tx_ampdu_builds ?
+		   div_u64(wifi->stats.tx_ampdu_build_cycles,
+			   wifi->stats.tx_ampdu_builds) : 0);
+	seq_printf(m, "tx_txq_wakes = %d pulled = %d\n",
+		   wifi->stats.tx_txq_wakes,
+		   wifi->stats.tx_txq_pulled);
+	seq_printf(m, "tx_frames_per_desc_avg = %llu (x100)\n",
+		   wifi->stats.tx_descs_sent ?
+		   div_u64(wifi->stats.tx_desc_frames * 100,
+			   wifi->stats.tx_descs_sent) : 0);
 	seq_printf(m, "tx_cmd_send_count_beacon_q = %d\n",
 		   wifi->stats.tx_cmd_send_count_beaconq);
 	seq_printf(m, "tx_done_recv_count = %d\n",
@@ -3591,15 +3744,23 @@ static int proc_read_mac_stats(struct seq_file *m, void *v)
 			if (!dev->peers[i])
 				continue;
 
+			seq_printf(m, "peer:%d airtime_us = %llu tx_bytes = %llu\n",
+				   i,
+				   dev->tx.airtime[i],
+				   dev->tx.tx_bytes[i]);
+
 			for (j = 0; j < WLAN_AC_MAX_CNT; j++) {
 				spin_lock_bh(&dev->tx.lock);
-				pend_pkt_q = &dev->tx.pending_pkt[0][i][j];
-				if (skb_queue_len(pend_pkt_q))
+				pend_pkt_q = dev->tx.pending_pkt[0][i][j];
+				if (tx_pend_q_len(pend_pkt_q))
 					seq_printf(m,
-						   "ac:%d peer:%d = %d\n",
+						   "ac:%d peer:%d = %d (%d/%d) deficit: %d\n",
 						   j,
 						   i,
-						   skb_queue_len(pend_pkt_q));
+						   tx_pend_q_len(pend_pkt_q),
+						   skb_queue_len(&pend_pkt_q[0]),
+						   skb_queue_len(&pend_pkt_q[1]),
+						   dev->tx.deficit[i][j]);
 				spin_unlock_bh(&dev->tx.lock);
 			}
 		}
@@ -3873,6 +4034,11 @@ static ssize_t proc_write_config(struct file *file,
 				wifi->params.enable_early_agg_checks = val;
 		} else
 			pr_err("Invalid parameter value: Allowed: 0/1\n");
+	} else if (param_get_val(buf, "airtime_fair=", &val)) {
+		if ((val == 0) || (val == 1))
+			wifi->params.airtime_fair = val;
+		else
+			pr_err("Invalid parameter value: Allowed: 0/1\n");
 	} else if (param_get_val(buf, "antenna_sel=", &val)) {
 		if (val == 1 || val == 2) {
 			if (val != wifi->params.antenna_sel) {
@@ -4513,6 +4679,17 @@ static ssize_t proc_write_config(struct file *file,
 			goto error;
 		}
 		CALL_UMAC(uccp420wlan_prog_clear_stats);
+	} else if (param_get_val(buf, "tx_token_bench=", &val)) {
+		if (dev->state != STARTED) {
+			pr_err("Interface is not initialized\n");
+			goto error;
+		}
+
+		if (val >= 1 && val <= TX_TOKEN_BENCH_MAX)
+			uccp420wlan_tx_token_bench(dev, val);
+		else
+			pr_err("Invalid parameter value: Allowed values: 1 - %d\n",
+			       TX_TOKEN_BENCH_MAX);
 	} else if (param_get_val(buf, "disable_beacon_ibss=", &val)) {
 		if ((val == 1) || (val == 0))
 			wifi->params.disable_beacon_ibss = val;
@@ -4656,6 +4833,7 @@ static int proc_init(struct proc_dir_entry ***main_dir_entry)
 		wifi->params.uccp_num_spatial_streams = num_streams_vpd;
 
 	wifi->params.enable_early_agg_checks = 1;
+	wifi->params.airtime_fair = 1;
 	wifi->params.bt_state = 1;
 
 	/* Defaults optimized for all IMG clients
@@ -1198,6 +1198,7 @@ void uccp420wlan_rx_frame(struct sk_buff *skb, void *context)
 	int i;
 	static unsigned int rssi_index;
 	struct ieee80211_vif *vif = NULL;
+	struct napi_struct *napi = NULL;
 
 	/* Remove RX control information:
 	 * unused more_cmd_data in RX direction is used to indicate QoS/Non-Qos
@@ -1388,7 +1389,14 @@ void uccp420wlan_rx_frame(struct sk_buff *skb, void *context)
 			skb->data, skb->len, 1);
 
 	memcpy(IEEE80211_SKB_RXCB(skb), &rx_status, sizeof(rx_status));
-	ieee80211_rx(dev->hw, skb);
+
+	/* Frames passed up from the HAL NAPI poll go through GRO */
+	napi = hal_ops.get_rx_napi();
+
+	if (napi)
+		ieee80211_rx_napi(dev->hw, NULL, skb, napi);
+	else
+		ieee80211_rx(dev->hw, skb);
 }
 
 
@@ -25,19 +25,23 @@
 #include <asm/unaligned.h>
 
 #include <linux/clk.h>
+#include <linux/debugfs.h>
 #include <linux/etherdevice.h>
+#include <linux/hrtimer.h>
 #include <linux/iio/consumer.h>
 #include <linux/interrupt.h>
+#include <linux/kthread.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/netdevice.h>
 #include <linux/of.h>
 #include <linux/of_net.h>
 #include <linux/of_device.h>
+#include <linux/percpu.h>
 #include <linux/proc_fs.h>
 #include <linux/skbuff.h>
 #include <linux/slab.h>
-#include <linux/sort.h>
 #include <linux/syscore_ops.h>
 #include <linux/time.h>
 
@@ -59,6 +63,21 @@ static int init_rx_buf(int pkt_desc,
 		       struct sk_buff *new_skb);
 
 static int is_mem_bounce(void *virt_addr, int len);
+static struct sk_buff *hal_rx_alloc_skb(unsigned int max_data_size);
+static void hal_rx_bulk_alloc(struct hal_priv *priv, struct event_hal *evnt);
+static void hal_rx_pool_adapt(struct hal_priv *priv);
+static void hal_rx_hist_update(struct hal_priv *priv,
+			       unsigned int data_length,
+			       unsigned int max_data_size);
+static struct sk_buff *hal_rx_bulk_get(struct hal_priv *priv,
+				       unsigned int max_data_size);
+static void hal_rx_bulk_release(struct hal_priv *priv);
+static void hal_event_ring_request(struct hal_priv *priv, int enable);
+static void hal_cmd_ring_request(struct hal_priv *priv, int enable);
+static void hal_hist_add(enum hal_hist_id id, u64 val);
+static void hal_cmd_buf_put(struct hal_priv *priv, struct sk_buff *skb);
+static int hal_fetch_event(struct hal_priv *priv);
+int hal_unmap_tx_buf(int pkt_desc, int frame_id);
 
 static struct hal_priv *hpriv;
 static const char *hal_name = "UCCP420_WIFI_HAL";
@@ -66,6 +85,31 @@ static const char *hal_name = "UCCP420_WIFI_HAL";
 static unsigned long shm_offset = HAL_SHARED_MEM_OFFSET;
 module_param(shm_offset, ulong, S_IRUSR|S_IWUSR);
 
+#define HAL_NAPI_WEIGHT 64
+
+/* RX processing: 1 - NAPI polling, 0 - tasklets. Set in debugfs, taken
+ * on the next hal_start.
+ */
+static u32 rx_napi = 1;
+
+/* Entries requested for the FW event ring, 0 for the single event slot.
+ * Set in debugfs, taken on the next FW reset.
+ */
+static u32 event_ring = 16;
+
+/* Same for the FW command ring, 0 for the single command slot */
+static u32 cmd_ring = 8;
+
+/* Map the frames of a TX descriptor with one scatterlist, set in debugfs */
+static u32 tx_map_batch = 1;
+
+/* Copy commands and TX data through the WC mapping, set in debugfs */
+static u32 gram_wc = 1;
+
+#define HAL_CMD_TIMEOUT_MS 1000
+#define HAL_CMD_BACKOFF_MIN_US 2
+#define HAL_CMD_BACKOFF_MAX_US 256
+
 unsigned int hal_cmd_sent;
 unsigned int hal_event_recv;
 struct timer_list stats_timer;
@@ -75,25 +119,28 @@ unsigned int alloc_skb_priv_tx_region;
 unsigned int alloc_skb_priv_rx_region;
 unsigned int alloc_skb_priv_runtime;
 
+/* Spin on the command slot before backing off, set in hal_stats */
+static unsigned int cmd_spin_us = 10;
+
+/* RX buffers left with the FW that force a refill, set in hal_stats */
+static unsigned int rx_refill_lowat = 4 * MAX_RX_BUF_PTR_PER_CMD;
+
+/* Interrupt moderation (NAPI mode), tunable through hal_stats */
+static unsigned int irq_holdoff_us;
+static unsigned int irq_max_events = 8;
+static unsigned int irq_adaptive;
+
 static unsigned int uccp_ddr_base;
 static unsigned int phys_64mb;
 static void __iomem *sixfour_mb_base;
 
-#ifdef PERF_PROFILING
-/* The timing markers */
-unsigned long irq_timestamp[20] = {0};
-unsigned long rcv_hdlr_time[20] = {0};
-unsigned long rx_pkts_halint_event[20] = {0};
-unsigned long halint_event_handling_time[20] = {0};
-unsigned long pflags;
-
-/*Indexs for current sample*/
-unsigned int halint_handling_index;
-unsigned int rx_pkt_index;
-unsigned int rcv_hdlr_index;
-unsigned int irq_ts_index;
-spinlock_t  timing_lock;
-#endif
+/* Datapath latency histograms, updated on the local CPU only */
+struct hal_hist_cpu {
+	struct hal_hist hist[HAL_HIST_MAX];
+};
+
+static DEFINE_PER_CPU(struct hal_hist_cpu, hal_hist_cpu);
+static struct dentry *hal_debugfs_dir;
 
 #ifdef HAL_DEBUG
 #define _HAL_DEBUG(fmt, args...) pr_debug(fmt, ##args)
@@ -294,10 +341,36 @@ int hal_get_dump_sysbus(unsigned long  *dump_start)
 
 }
 
+/* Address to use for a bulk write to the packed GRAM: the WC alias when
+ * gram_wc is set and the range is in the WC area. The writes are only
+ * guaranteed to have reached GRAM after a wmb().
+ */
+static void __iomem *hal_gram_wc(struct hal_priv *priv,
+				 unsigned long addr,
+				 unsigned int len)
+{
+	if (!gram_wc || !priv->gram_wc_base_addr ||
+	    addr < priv->gram_wc_start ||
+	    addr + len > priv->gram_wc_start + priv->gram_wc_len)
+		return (void __iomem *)addr;
+
+	return (void __iomem *)(addr - priv->gram_wc_start +
+				priv->gram_wc_base_addr);
+}
+
+
 static int hal_reset_hal_params(void)
 {
 	hpriv->cmd_cnt = COMMAND_START_MAGIC;
 	hpriv->event_cnt = 0;
+	hal_event_ring_request(hpriv, 0);
+	hal_cmd_ring_request(hpriv, 0);
+
+	/* GRAM contents are unknown after a reset, rewrite all entries */
+	if (hpriv->hal_tx_data_gram)
+		memset(hpriv->hal_tx_data_gram, 0xff,
+		       NUM_TX_DESC * TX_DESC_HAL_SIZE);
+
 	return 0;
 }
 
@@ -316,15 +389,278 @@ static int hal_ready(struct hal_priv *priv)
 }
 
 
+/* Wait for the FW to pick up the previous command. After a short spin the
+ * tasklet backs off and is rescheduled by the poll timer or by the next
+ * event from the FW. Returns 1 if the slot is free, 0 if the wait was
+ * deferred and -1 if the FW did not pick up the command in time.
+ */
+static int hal_cmd_slot_ready(struct hal_priv *priv)
+{
+	u64 start, now;
+
+	if (hal_ready(priv))
+		goto ready;
+
+	start = ktime_get_ns();
+
+	do {
+		cpu_relax();
+		now = ktime_get_ns();
+
+		if (hal_ready(priv)) {
+			priv->cmd_spin_ns += now - start;
+			goto ready;
+		}
+	} while (now - start < cmd_spin_us * NSEC_PER_USEC);
+
+	priv->cmd_spin_ns += now - start;
+
+	if (!priv->cmd_wait_start) {
+		priv->cmd_wait_start = start;
+		priv->cmd_backoff_us = HAL_CMD_BACKOFF_MIN_US;
+		priv->cmd_slot_waits++;
+	} else if (now - priv->cmd_wait_start >
+		   HAL_CMD_TIMEOUT_MS * NSEC_PER_MSEC) {
+		priv->cmd_wait_start = 0;
+		priv->cmd_timeouts++;
+		return -1;
+	}
+
+	hrtimer_start(&priv->cmd_timer,
+		      ktime_set(0, priv->cmd_backoff_us * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+
+	priv->cmd_backoff_us = min_t(unsigned int, priv->cmd_backoff_us * 2,
+				     HAL_CMD_BACKOFF_MAX_US);
+
+	return 0;
+
+ready:
+	if (priv->cmd_wait_start) {
+		hal_hist_add(HAL_HIST_CMD_WAIT,
+			     ktime_get_ns() - priv->cmd_wait_start);
+		priv->cmd_wait_start = 0;
+	}
+
+	return 1;
+}
+
+
+static enum hrtimer_restart hal_cmd_timer_fn(struct hrtimer *timer)
+{
+	struct hal_priv *priv = container_of(timer, struct hal_priv,
+					     cmd_timer);
+
+	tasklet_schedule(&priv->tx_tasklet);
+
+	return HRTIMER_NORESTART;
+}
+
+
+/* Put a command back at the head of txq and try again after a backoff */
+static void hal_cmd_retry(struct hal_priv *priv, struct sk_buff *skb)
+{
+	if (skb)
+		skb_queue_head(&priv->txq, skb);
+
+	priv->cmd_retries++;
+
+	hrtimer_start(&priv->cmd_timer,
+		      ktime_set(0, HAL_CMD_BACKOFF_MAX_US * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+}
+
+
+/* Ask the FW to take commands from a ring, the answer is checked by the
+ * TX tasklet so the switch is serialised with command submission. Only
+ * done for a FW that advertises the ring, enable is 0 to go back to the
+ * single slot.
+ */
+static void hal_cmd_ring_request(struct hal_priv *priv, int enable)
+{
+	unsigned int entries = min_t(u32, cmd_ring, HAL_CMD_RING_MAX_ENTRIES);
+
+	priv->gram_cmd_ring = NULL;
+	priv->cmd_ring_entries = 0;
+	priv->cmd_ring_head = 0;
+	priv->cmd_ring_rung = 0;
+	priv->cmd_ring_pending = 0;
+
+	if (!enable || !entries)
+		return;
+
+	writel(0, (void __iomem *)HAL_GRAM_CMD_RING_RSP);
+	writel(HAL_CMD_RING_MAGIC | entries,
+	       (void __iomem *)HAL_GRAM_CMD_RING_REQ);
+	priv->cmd_ring_pending = entries;
+}
+
+
+static void hal_cmd_ring_check(struct hal_priv *priv)
+{
+	unsigned long offset, entries, size;
+	unsigned int requested = priv->cmd_ring_pending;
+	struct hal_gram_cmd_ring __iomem *ring;
+
+	offset = readl((void __iomem *)HAL_GRAM_CMD_RING_RSP);
+
+	if (!offset)
+		return;
+
+	priv->cmd_ring_pending = 0;
+	entries = readl((void __iomem *)HAL_GRAM_CMD_RING_RSP_ENTRIES);
+	size = sizeof(*ring) + entries * sizeof(ring->entry[0]);
+
+	if (!entries || entries > requested ||
+	    offset + size > priv->uccp_pkd_gram_len - priv->shm_offset) {
+		pr_err("%s: Invalid cmd ring offset: 0x%lx entries: %lu, using single slot\n",
+		       hal_name, offset, entries);
+		return;
+	}
+
+	ring = (struct hal_gram_cmd_ring __iomem *)(priv->gram_mem_addr +
+						     offset);
+	priv->cmd_ring_head = readl(&ring->head);
+	priv->cmd_ring_rung = priv->cmd_ring_head;
+	priv->cmd_ring_entries = entries;
+	priv->gram_cmd_ring = ring;
+
+	pr_info("%s: Command ring of %lu entries at 0x%lx\n",
+		hal_name, entries, offset);
+}
+
+
+/* Post as many queued commands as the ring has room for, then ring the
+ * doorbell once for all of them. The doorbell waits for the FW to ack the
+ * previous one, the entries are visible to the FW straight away.
+ */
+static void hal_cmd_ring_process(struct hal_priv *priv)
+{
+	struct hal_gram_cmd_ring __iomem *ring = priv->gram_cmd_ring;
+	struct sk_buff *skb;
+	unsigned int head, tail, slot, value;
+	unsigned long start_addr, max_len;
+	u64 start = 0;
+	int ready;
+
+	head = priv->cmd_ring_head;
+	tail = readl(&ring->tail);
+
+	while (head - tail < priv->cmd_ring_entries && !priv->hal_disabled) {
+		skb = skb_dequeue(&priv->txq);
+
+		if (!skb)
+			break;
+
+		slot = head % priv->cmd_ring_entries;
+		start_addr = readl(&ring->entry[slot].addr);
+		max_len = readl(&ring->entry[slot].max_len);
+
+		start_addr -= HAL_UCCP_GRAM_BASE;
+		start_addr += ((priv->gram_mem_addr)-(priv->shm_offset));
+
+		if ((start_addr < priv->gram_mem_addr) ||
+		    (start_addr > (priv->gram_mem_addr + HAL_UCCP_GRAM_LEN)) ||
+		    skb->len > max_len) {
+			pr_err_ratelimited("%s: Invalid cmd entry 0x%08x len %d, retrying cmd\n",
+					   hal_name, (unsigned int)start_addr,
+					   skb->len);
+			hal_cmd_retry(priv, skb);
+			break;
+		}
+
+		if (!start)
+			start = ktime_get_ns();
+
+		tx_cnt++;
+		memcpy_toio(hal_gram_wc(priv, start_addr, skb->len),
+			    skb->data, skb->len);
+		writel(skb->len, &ring->entry[slot].len);
+		head++;
+		hal_cmd_sent++;
+
+		hal_cmd_buf_put(priv, skb);
+	}
+
+	if (head != priv->cmd_ring_head) {
+		/* Publish the entries before the index */
+		wmb();
+		writel(head, &ring->head);
+		priv->cmd_ring_head = head;
+		hal_hist_add(HAL_HIST_CMD_POST, ktime_get_ns() - start);
+	}
+
+	if (head != priv->cmd_ring_rung) {
+		ready = hal_cmd_slot_ready(priv);
+
+		if (!ready)
+			return;
+
+		if (ready < 0)
+			pr_err("%s: Doorbell not acked for %dms\n",
+			       hal_name, HAL_CMD_TIMEOUT_MS);
+
+		hal_hist_add(HAL_HIST_CMD_BATCH, head - priv->cmd_ring_rung);
+
+		value = (unsigned int) (priv->cmd_cnt);
+		value |= 0x7fff0000;
+
+		/* WC writes must land before the doorbell */
+		wmb();
+		writel(value, (void __iomem *)(HOST_TO_MTX_CMD_ADDR));
+		priv->cmd_cnt++;
+		priv->cmd_ring_rung = head;
+		priv->cmd_doorbells++;
+	}
+
+	/* Ring full, resumed by the next event or the cmd timer */
+	if (!skb_queue_empty(&priv->txq) && !priv->hal_disabled)
+		hrtimer_start(&priv->cmd_timer,
+			      ktime_set(0,
+					HAL_CMD_BACKOFF_MAX_US * NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+}
+
+
 static void tx_tasklet_fn(unsigned long data)
 {
 	struct hal_priv *priv = (struct hal_priv *)data;
 	struct sk_buff *skb;
 	unsigned int value = 0;
 	unsigned long start_addr;
-	unsigned long start = 0;
+	u64 start;
+	int ready;
+
+	if (priv->cmd_ring_pending)
+		hal_cmd_ring_check(priv);
+
+	if (priv->gram_cmd_ring) {
+		hal_cmd_ring_process(priv);
+		return;
+	}
+
+	while (!skb_queue_empty(&priv->txq)) {
+		if (priv->hal_disabled)
+			break;
+
+		ready = hal_cmd_slot_ready(priv);
+
+		/* Resumed from the cmd timer or the next event */
+		if (!ready)
+			break;
+
+		if (ready < 0) {
+			pr_err("%s: Intf not ready for %dms, retrying cmd\n",
+			       hal_name, HAL_CMD_TIMEOUT_MS);
+			hal_cmd_retry(priv, NULL);
+			break;
+		}
+
+		skb = skb_dequeue(&priv->txq);
+
+		if (!skb)
+			break;
 
-	while ((skb = skb_dequeue(&priv->txq))) {
 		tx_cnt++;
 		UCCP_DEBUG_HAL("%s: tx_cnt=%ld cmd_cnt=0x%X event_cnt=0x%X\n",
 				hal_name,
@@ -337,26 +673,6 @@ static void tx_tasklet_fn(unsigned long data)
 					 skb->data, skb->len, 1);
 		}
 
-		start = jiffies;
-
-		while (!hal_ready(priv) &&
-		     time_before(jiffies, start + msecs_to_jiffies(1000))) {
-			cpu_relax();
-		}
-
-		if (!hal_ready(priv)) {
-			pr_err("%s: Intf not ready for 1000ms, dropping cmd\n",
-			       hal_name);
-			dev_kfree_skb_any(skb);
-			skb = NULL;
-		}
-
-		if (!skb)
-			continue;
-
-		if (priv->hal_disabled)
-			break;
-
 		/* Write the command buffer in GRAM */
 		start_addr = readl((void __iomem *)HAL_GRAM_CMD_START);
 
@@ -368,24 +684,32 @@ static void tx_tasklet_fn(unsigned long data)
 
 		if ((start_addr < priv->gram_mem_addr) ||
 		    (start_addr > (priv->gram_mem_addr + HAL_UCCP_GRAM_LEN))) {
-			pr_err("%s: Invalid cmd addr 0x%08x, dropping cmd\n",
-			       hal_name, (unsigned int)start_addr);
-			dev_kfree_skb_any(skb);
-			skb = NULL;
-			continue;
+			pr_err_ratelimited("%s: Invalid cmd addr 0x%08x, retrying cmd\n",
+					   hal_name, (unsigned int)start_addr);
+			hal_cmd_retry(priv, skb);
+			break;
 		}
 
-		memcpy((unsigned char *)start_addr, skb->data, skb->len);
+		start = ktime_get_ns();
+
+		memcpy_toio(hal_gram_wc(priv, start_addr, skb->len),
+			    skb->data, skb->len);
 
 		writel(skb->len, (void __iomem *)HAL_GRAM_CMD_LEN);
 
 		value = (unsigned int) (priv->cmd_cnt);
 		value |= 0x7fff0000;
+
+		/* Command written through the WC mapping must land first */
+		wmb();
 		writel(value, (void __iomem *)(HOST_TO_MTX_CMD_ADDR));
+		hal_hist_add(HAL_HIST_CMD_POST, ktime_get_ns() - start);
 		priv->cmd_cnt++;
 		hal_cmd_sent++;
+		priv->cmd_doorbells++;
+		hal_hist_add(HAL_HIST_CMD_BATCH, 1);
 
-		dev_kfree_skb_any(skb);
+		hal_cmd_buf_put(priv, skb);
 	}
 }
 
@@ -405,6 +729,56 @@ static void hostport_send_head(struct hal_priv  *priv,
 }
 
 
+/* Write the used TX data entries of a descriptor to GRAM. Entries that
+ * are the same as in GRAM are skipped, the rest is written as 32-bit
+ * words covering the first to the last changed entry.
+ */
+static void hal_tx_data_write(struct hal_priv *priv, unsigned int desc_id)
+{
+	unsigned int base = desc_id * NUM_FRAMES_IN_TX_DESC;
+	unsigned int used = priv->tx_slots_used[desc_id];
+	struct hal_tx_data *host = &priv->hal_tx_data[base];
+	struct hal_tx_data *gram = &priv->hal_tx_data_gram[base];
+	unsigned int first, last, start, end;
+
+	for (first = 0; first < used; first++)
+		if (memcmp(&host[first], &gram[first], NUM_BYTES_PER_FRAME))
+			break;
+
+	if (first == used) {
+		priv->tx_data_skipped++;
+		return;
+	}
+
+	for (last = used - 1; last > first; last--)
+		if (memcmp(&host[last], &gram[last], NUM_BYTES_PER_FRAME))
+			break;
+
+	/* Entries are 9 bytes, align the range to words. The descriptor
+	 * block is word aligned in GRAM and in the host copy.
+	 */
+	start = round_down(first * NUM_BYTES_PER_FRAME, 4);
+	end = min_t(unsigned int,
+		    round_up((last + 1) * NUM_BYTES_PER_FRAME, 4),
+		    TX_DESC_HAL_SIZE);
+
+	__iowrite32_copy(hal_gram_wc(priv, HAL_GRAM_TX_DATA_START +
+				     (desc_id * TX_DESC_HAL_SIZE) + start,
+				     end - start),
+			 (unsigned char *)host + start,
+			 (end - start) / 4);
+
+	memcpy((unsigned char *)gram + start, (unsigned char *)host + start,
+	       end - start);
+
+	/* The command may be posted from another CPU, drain the WC buffer */
+	wmb();
+
+	priv->tx_data_writes++;
+	priv->tx_data_bytes += end - start;
+}
+
+
 static void hal_send(void *nwb,
 		     unsigned char rcv_mod_id,
 		     unsigned char send_mod_id,
@@ -413,8 +787,8 @@ static void hal_send(void *nwb,
 	struct sk_buff *cmd = (struct sk_buff *)nwb, *skb, *tmp;
 	struct sk_buff_head *skb_list;
 	struct hal_hdr *hdr;
-	unsigned long dcp_start_addr;
 	unsigned int pkt = 0, desc_id = 0, frame_id = 0;
+	unsigned int slot, nslots;
 	struct hal_tx_data *hal_tx_data = NULL;
 	struct buf_info *tx_buf_info = NULL;
 	dma_addr_t dma_buf;
@@ -429,26 +803,27 @@ static void hal_send(void *nwb,
 
 		skb_queue_walk_safe(skb_list, skb, tmp)
 			{
-			frame_id = (desc_id * NUM_FRAMES_IN_TX_DESC) + pkt;
-			hal_tx_data = &hpriv->hal_tx_data[frame_id];
-			tx_buf_info = &hpriv->tx_buf_info[frame_id];
+			slot = hpriv->tx_frame_slot[desc_id][pkt];
+			nslots = hpriv->tx_frame_nslots[desc_id][pkt];
+			frame_id = (desc_id * NUM_FRAMES_IN_TX_DESC) + slot;
+
+			for (; nslots; nslots--, frame_id++) {
+				hal_tx_data = &hpriv->hal_tx_data[frame_id];
+				tx_buf_info = &hpriv->tx_buf_info[frame_id];
 
-			hal_tx_data->data_len = tx_buf_info->dma_buf_len;
+				hal_tx_data->data_len =
+					tx_buf_info->dma_buf_len;
 
-			dma_buf = tx_buf_info->dma_buf;
-			dma_buf -= uccp_ddr_base;
+				dma_buf = tx_buf_info->dma_buf;
+				dma_buf -= uccp_ddr_base;
 
-			hal_tx_data->address = dma_buf >> 2;
-			hal_tx_data->offset = dma_buf & 0x00000003;
+				hal_tx_data->address = dma_buf >> 2;
+				hal_tx_data->offset = dma_buf & 0x00000003;
+			}
 			pkt++;
 			}
 
-		dcp_start_addr = HAL_GRAM_TX_DATA_START +
-				 (desc_id * TX_DESC_HAL_SIZE);
-
-		memcpy((void *)dcp_start_addr,
-		       &hpriv->hal_tx_data[(desc_id * NUM_FRAMES_IN_TX_DESC)],
-		       TX_DESC_HAL_SIZE);
+		hal_tx_data_write(hpriv, desc_id);
 	}
 
 	hostport_send(hpriv, nwb);
@@ -467,66 +842,337 @@ static void recv_tasklet_fn(unsigned long data)
 	}
 }
 
-static void rx_tasklet_fn(unsigned long data)
+static int hal_event_enqueue(struct hal_priv *priv,
+			     unsigned long event_addr,
+			     unsigned long event_status_addr,
+			     unsigned long event_len)
+{
+	unsigned int head = priv->event_head;
+	struct hal_event_desc *desc;
+
+	if (head - ACCESS_ONCE(priv->event_tail) >= HAL_EVENT_RING_SIZE)
+		return -1;
+
+	desc = &priv->event_ring[head & (HAL_EVENT_RING_SIZE - 1)];
+	desc->addr = event_addr;
+	desc->status_addr = event_status_addr;
+	desc->len = event_len;
+
+	/* Publish the entry before the index */
+	smp_wmb();
+	priv->event_head = head + 1;
+
+	return 0;
+}
+
+
+static int hal_event_dequeue(struct hal_priv *priv,
+			     struct hal_event_desc *desc)
+{
+	unsigned int tail = priv->event_tail;
+
+	if (tail == ACCESS_ONCE(priv->event_head))
+		return 0;
+
+	smp_rmb();
+	*desc = priv->event_ring[tail & (HAL_EVENT_RING_SIZE - 1)];
+	smp_mb();
+	priv->event_tail = tail + 1;
+
+	return 1;
+}
+
+
+static int hal_event_ring_empty(struct hal_priv *priv)
+{
+	return priv->event_tail == ACCESS_ONCE(priv->event_head);
+}
+
+
+/* LMAC events go up in an skb owned by the handler, which may pass it on
+ * to mac80211. The data comes from the per-CPU page fragment cache.
+ */
+static struct sk_buff *hal_event_skb_get(struct hal_priv *priv,
+					 unsigned long event_len)
+{
+	priv->event_skb_allocs++;
+
+	return dev_alloc_skb(event_len);
+}
+
+
+/* Command buffers come from a fixed pool owned by the HAL, never seen by
+ * the rest of the stack. A buffer is claimed by setting its bit in
+ * cmd_pool_busy, no lock is needed, and given back with hal_cmd_buf_put
+ * once sent or dropped. The pool is only bypassed for oversized commands
+ * or if all buffers are in flight.
+ */
+static struct sk_buff *hal_cmd_buf_get(struct hal_priv *priv,
+				       unsigned int len)
+{
+	struct sk_buff *skb;
+	unsigned int i, index;
+
+	if (len <= HAL_CMD_BUF_SIZE) {
+		for (i = 0; i < HAL_CMD_POOL_SIZE; i++) {
+			index = (priv->cmd_pool_next + i) % HAL_CMD_POOL_SIZE;
+			skb = priv->cmd_pool[index];
+
+			if (!skb || test_and_set_bit_lock(index,
+							   &priv->cmd_pool_busy))
+				continue;
+
+			priv->cmd_pool_next = index + 1;
+			skb->data = skb->head;
+			skb->len = 0;
+			skb->data_len = 0;
+			skb_reset_tail_pointer(skb);
+			memset(skb->cb, 0, sizeof(skb->cb));
+			priv->cmd_pool_hits++;
+
+			return skb;
+		}
+	}
+
+	priv->cmd_pool_miss++;
+
+	return alloc_skb(len, GFP_ATOMIC);
+}
+
+
+static void hal_cmd_buf_put(struct hal_priv *priv, struct sk_buff *skb)
+{
+	unsigned int i;
+
+	for (i = 0; i < HAL_CMD_POOL_SIZE; i++) {
+		if (priv->cmd_pool[i] == skb) {
+			clear_bit_unlock(i, &priv->cmd_pool_busy);
+			return;
+		}
+	}
+
+	dev_kfree_skb_any(skb);
+}
+
+
+static void *hal_get_cmd_buf(unsigned int len)
+{
+	return hal_cmd_buf_get(hpriv, len);
+}
+
+
+static void hal_free_cmd_buf(void *buf)
+{
+	hal_cmd_buf_put(hpriv, (struct sk_buff *)buf);
+}
+
+
+/* RX buffer refill
+ *
+ * Buffers given back to the FW are batched across events into refill
+ * commands of up to MAX_RX_BUF_PTR_PER_CMD buffers. The batches are
+ * flushed when one is full, when the FW runs low on buffers
+ * (rx_refill_lowat overall or half of the 12K pool), and at the end of
+ * the bottom half run. A batch that cannot be sent is kept, and further
+ * buffers go to the next one, there are enough batches for every RX
+ * descriptor so none is ever dropped.
+ */
+static int hal_rx_refill_send(struct hal_priv *priv, struct cmd_hal *cmd_rx)
+{
+	struct sk_buff *nbuf;
+	unsigned int i;
+
+	cmd_rx->hdr.id = 0xffffffff;
+
+	/* Inform HAL about the newly allocated buffers */
+	nbuf = hal_cmd_buf_get(priv, sizeof(struct cmd_hal));
+
+	if (!nbuf)
+		return -1;
+
+	memcpy(skb_put(nbuf, sizeof(struct cmd_hal)),
+	       (unsigned char *)cmd_rx,
+	       sizeof(struct cmd_hal));
+	hal_cmd_sent--;
+	hostport_send_head(priv, nbuf);
+
+	for (i = 0; i < cmd_rx->rx_pkt_data.rx_pkt_cnt; i++) {
+		if (cmd_rx->rx_pkt_data.rx_pkt[i].desc < priv->rx_bufs_12k)
+			priv->rx_bufs_12k_fw++;
+		priv->rx_bufs_fw++;
+	}
+
+	priv->rx_refill_cmds++;
+	priv->rx_refill_bufs += cmd_rx->rx_pkt_data.rx_pkt_cnt;
+
+	return 0;
+}
+
+
+static void hal_rx_refill_flush(struct hal_priv *priv)
+{
+	unsigned int sent = 0;
+
+	while (sent < priv->refill_cmds_used) {
+		if (!priv->refill_cmds[sent].rx_pkt_data.rx_pkt_cnt ||
+		    hal_rx_refill_send(priv, &priv->refill_cmds[sent]))
+			break;
+		sent++;
+	}
+
+	if (!sent)
+		return;
+
+	/* Unsent batches move to the front, oldest first */
+	memmove(priv->refill_cmds, priv->refill_cmds + sent,
+		(priv->refill_cmds_used - sent) * sizeof(struct cmd_hal));
+	memset(priv->refill_cmds + priv->refill_cmds_used - sent, 0,
+	       sent * sizeof(struct cmd_hal));
+	priv->refill_cmds_used -= sent;
+}
+
+
+static struct hal_rx_command *hal_rx_refill_tail(struct hal_priv *priv)
+{
+	if (!priv->refill_cmds_used)
+		priv->refill_cmds_used = 1;
+
+	return &priv->refill_cmds[priv->refill_cmds_used - 1].rx_pkt_data;
+}
+
+
+static void hal_rx_refill_add(struct hal_priv *priv,
+			      unsigned int pkt_desc,
+			      dma_addr_t dma_buf)
+{
+	struct hal_rx_command *rx = hal_rx_refill_tail(priv);
+
+	if (rx->rx_pkt_cnt == MAX_RX_BUF_PTR_PER_CMD) {
+		/* Previous flush failed, try again */
+		hal_rx_refill_flush(priv);
+		rx = hal_rx_refill_tail(priv);
+	}
+
+	if (rx->rx_pkt_cnt == MAX_RX_BUF_PTR_PER_CMD) {
+		/* Still pending, start the next batch */
+		if (priv->refill_cmds_used == priv->refill_cmds_max) {
+			pr_err("%s: Unable to refill RX desc %d\n",
+			       hal_name, pkt_desc);
+			return;
+		}
+
+		priv->refill_cmds_used++;
+		rx = hal_rx_refill_tail(priv);
+	}
+
+	rx->rx_pkt[rx->rx_pkt_cnt].desc = pkt_desc;
+	rx->rx_pkt[rx->rx_pkt_cnt].ptr = dma_buf - uccp_ddr_base;
+	rx->rx_pkt_cnt++;
+
+	if ((rx->rx_pkt_cnt == MAX_RX_BUF_PTR_PER_CMD) ||
+	    (priv->rx_bufs_fw < rx_refill_lowat) ||
+	    (priv->rx_bufs_12k_fw < priv->rx_bufs_12k / 2))
+		hal_rx_refill_flush(priv);
+}
+
+
+static void hal_hist_add(enum hal_hist_id id, u64 val)
+{
+	struct hal_hist *hist;
+	unsigned int bucket;
+
+	bucket = min_t(unsigned int, fls64(val), HAL_HIST_BUCKETS - 1);
+
+	hist = &get_cpu_ptr(&hal_hist_cpu)->hist[id];
+	hist->cnt[bucket]++;
+
+	if (val > hist->max)
+		hist->max = val;
+
+	put_cpu_ptr(&hal_hist_cpu);
+}
+
+
+/* Account the delay from the interrupt to the start of the bottom half */
+static void hal_hist_bh_start(struct hal_priv *priv)
+{
+	u32 ts = xchg(&priv->irq_ts, 0);
+
+	if (ts)
+		hal_hist_add(HAL_HIST_IRQ_TO_BH, (u32)ktime_get_ns() - ts);
+}
+
+
+/* Process up to budget events from the event ring, returns the number
+ * processed
+ */
+static int hal_rx_process(struct hal_priv *priv, int budget)
 {
-	struct hal_priv *priv = (struct hal_priv *)data;
 	struct sk_buff  *skb;
-	unsigned char *buf;
-	unsigned long temp;
-	unsigned char *nbuff;
-	struct event_hal *evnt;
-	struct cmd_hal cmd_rx;
-	struct sk_buff *nbuf, *rx_skb;
-	unsigned char *cmd_data;
+	struct hal_event_desc event;
+	struct event_hal hal_evnt;
+	struct event_hal *evnt = &hal_evnt;
+	int is_hal_evnt;
+	struct sk_buff *rx_skb;
 	unsigned int payload_length, length, data_length;
 	void __iomem *src_ptr;
 	int count = 0;
 	unsigned int pkt_desc = 0, max_data_size = MAX_DATA_SIZE_2K;
 	dma_addr_t dma_buf = 0;
-	unsigned long event_addr, event_status_addr, event_len;
-#ifdef PERF_PROFILING
-	struct timeval  tv_start, tv_now, full_tv_start, full_tv_now;
-	long usec_diff = 0, full_usec_diff = 0;
-#endif
+	u64 start;
 	struct buf_info *rx_buf_info = NULL;
 	struct buf_info temp_rx_buf_info;
 	struct sk_buff *new_skb;
+	int done = 0;
 
-	while ((skb = skb_dequeue(&priv->rxq))) {
-		event_addr = *((unsigned long *)(skb->cb));
-		event_status_addr = *((unsigned long *)(skb->cb + 4));
-		event_len = *(unsigned long *)(skb->cb + 8);
+	while (done < budget && hal_event_dequeue(priv, &event)) {
+		done++;
+		skb = NULL;
 
-		/* Range check */
-		if (skb->len > event_len) {
-			pr_err("%s: Err! skb->len=%d, event_len =%d\n",
-			       __func__, skb->len, (int)event_len);
-			dev_kfree_skb_any(skb);
-			continue;
+		if (DUMP_HAL) {
+			UCCP_DEBUG_HAL("%s: recv dump\n", hal_name);
+			UCCP_DEBUG_DUMP_HAL(" ", DUMP_PREFIX_NONE, 16, 1,
+					    (unsigned char *)event.addr,
+					    event.len, 1);
 		}
 
-		temp = event_addr;
-		buf = skb_put(skb, event_len);
-		memcpy(buf, (unsigned char *)temp, skb->len);
+		/* HAL internal events are consumed here, parse them from
+		 * GRAM without an skb. LMAC events the UMAC can handle in
+		 * place (TX done) go to the filter, only the rest go up in
+		 * an skb.
+		 */
+		is_hal_evnt = (*((unsigned int *)event.addr) == 0xffffffff);
+
+		if (is_hal_evnt) {
+			memset(evnt, 0, sizeof(struct event_hal));
+			memcpy(evnt, (unsigned char *)event.addr,
+			       min_t(unsigned long, event.len,
+				     sizeof(struct event_hal)));
+		} else if (priv->rx_filter &&
+			   priv->rx_filter((void *)event.addr, event.len) ==
+			   HAL_RX_DROP) {
+			priv->event_inplace++;
+		} else {
+			skb = hal_event_skb_get(priv, event.len);
+
+			if (skb)
+				memcpy(skb_put(skb, event.len),
+				       (unsigned char *)event.addr,
+				       event.len);
+		}
 
 		/* Mark the buffer free */
-		temp = event_status_addr;
-
 		UCCP_DEBUG_HAL("%s: Freeing event buffer at 0x%08x\n",
-			 hal_name, (unsigned int)temp);
+			 hal_name, (unsigned int)event.status_addr);
 
-		*((unsigned long *)temp) = 0;
+		*((unsigned long *)event.status_addr) = 0;
+
+		/* The FW may reuse the buffer as soon as it sees the clear */
+		wmb();
 
 		rx_cnt++;
 		UCCP_DEBUG_HAL("%s:rx_cnt=%ld cmd_cnt=0x%X event_cnt=0x%X\n",
 			 hal_name, rx_cnt, priv->cmd_cnt, priv->event_cnt);
-		if (DUMP_HAL) {
-			UCCP_DEBUG_HAL("%s: recv dump\n", hal_name);
-			UCCP_DEBUG_DUMP_HAL(" ", DUMP_PREFIX_NONE, 16, 1,
-						skb->data, skb->len, 1);
-		}
-		nbuff = skb->data;
-		evnt = (struct event_hal *)nbuff;
 
 		/* Message from HAL after the DMA completion,
 		 * Fetch the buffer addrs from UCCP HOST RAM
@@ -534,25 +1180,20 @@ static void rx_tasklet_fn(unsigned long data)
 		 * Pass them up
 		 * Refresh the RX descriptor in firmware
 		 */
-		if (evnt->hdr.id == 0xffffffff) {
+		if (is_hal_evnt) {
 			/* HAL_INTERNAL CMD */
-			memset(&cmd_rx, 0, sizeof(struct cmd_hal));
-
 			if (!CHECK_RX_PKT_CNT(evnt->rx_pkt_cnt)) {
 				/* Range check */
 				pr_err("%s: Error!!! rx_pkt_cnt = %d\n",
 				       __func__, evnt->rx_pkt_cnt);
-				dev_kfree_skb_any(skb);
 				continue;
 			}
 
-#ifdef PERF_PROFILING
-			do_gettimeofday(&full_tv_start);
+			start = ktime_get_ns();
+			hal_hist_add(HAL_HIST_RX_PKT_CNT, evnt->rx_pkt_cnt);
+
+			hal_rx_bulk_alloc(priv, evnt);
 
-			/* HAL Profile Stat: Rx Pkts per HAL internal Event */
-			rx_pkts_halint_event[rx_pkt_index] = evnt->rx_pkt_cnt;
-			rx_pkt_index = (rx_pkt_index + 1) % 20;
-#endif
 			for (count = 0; count < evnt->rx_pkt_cnt; count++) {
 				pkt_desc = evnt->rx_pkt_desc[count];
 
@@ -570,12 +1211,19 @@ static void rx_tasklet_fn(unsigned long data)
 
 				if (pkt_desc < hpriv->rx_bufs_12k)
 					max_data_size = MAX_DATA_SIZE_12K;
+				else
+					max_data_size = MAX_DATA_SIZE_2K;
 
 				if (hpriv->rx_buf_info == NULL)
 					break;
 
 				rx_buf_info = hpriv->rx_buf_info + pkt_desc;
 
+				/* Buffer is back with the host */
+				if (pkt_desc < hpriv->rx_bufs_12k)
+					priv->rx_bufs_12k_fw--;
+				priv->rx_bufs_fw--;
+
 				memcpy(&temp_rx_buf_info,
 				       rx_buf_info,
 				       sizeof(struct buf_info));
@@ -647,8 +1295,8 @@ static void rx_tasklet_fn(unsigned long data)
 						       DUMP_PREFIX_NONE,
 						       16,
 						       1,
-						       skb->data,
-						       skb->len,
+						       evnt,
+						       sizeof(struct event_hal),
 						       1);
 
 					pr_err("DMA Data from LMAC:");
@@ -671,272 +1319,689 @@ static void rx_tasklet_fn(unsigned long data)
 						       rx_buf_info->src_ptr,
 						       max_data_size,
 						       DMA_FROM_DEVICE);
-					cmd_rx.rx_pkt_data.rx_pkt_cnt++;
-					cmd_rx.rx_pkt_data.rx_pkt[count].desc =
-						evnt->rx_pkt_desc[count];
-					cmd_rx.rx_pkt_data.rx_pkt[count].ptr  =
-						dma_buf - uccp_ddr_base;
+					hal_rx_refill_add(priv, pkt_desc,
+							  dma_buf);
+					continue;
+				}
+
+				if (priv->rx_filter &&
+				    priv->rx_filter(src_ptr, data_length) ==
+				    HAL_RX_DROP) {
+					/* Consumed by the filter, give the same
+					 * buffer back to the FW
+					 */
+					dma_map_single(NULL,
+						       rx_buf_info->src_ptr,
+						       max_data_size,
+						       DMA_FROM_DEVICE);
+					hal_rx_refill_add(priv, pkt_desc,
+							  dma_buf);
+					priv->rx_filter_drops++;
 					continue;
 				}
 
-				new_skb = alloc_skb(max_data_size, GFP_ATOMIC);
+				hal_rx_hist_update(priv, data_length,
+						   max_data_size);
+
+				new_skb = hal_rx_bulk_get(priv, max_data_size);
+
+				if (!new_skb) {
+					/* If allocation fails, drop the packet,
+					 * continue
+					 */
+					memcpy(rx_buf_info,
+					       &temp_rx_buf_info,
+					       sizeof(struct buf_info));
+
+					dma_map_single(NULL,
+						       rx_buf_info->src_ptr,
+						       max_data_size,
+						       DMA_FROM_DEVICE);
+
+					dma_buf = rx_buf_info->dma_buf;
+				} else {
+					rx_skb = temp_rx_buf_info.skb;
+
+					if (temp_rx_buf_info.dma_buf_priv) {
+						memcpy(skb_put(rx_skb,
+						       data_length),
+						       src_ptr,
+						       data_length);
+						priv->rx_copy++;
+					} else {
+						skb_put(rx_skb, data_length);
+						priv->rx_zero_copy++;
+					}
+
+					init_rx_buf(pkt_desc, max_data_size,
+						    &dma_buf, new_skb);
+					skb_queue_tail(&hpriv->refillq, rx_skb);
+				}
+
+				hal_rx_refill_add(priv, pkt_desc, dma_buf);
+			}
+
+			hal_rx_bulk_release(priv);
+
+			hal_hist_add(HAL_HIST_RX_EVENT, ktime_get_ns() - start);
+
+			/* The NAPI poll or RX thread passes up the refillq */
+			if (!priv->rx_napi && !priv->rx_thread)
+				tasklet_schedule(&priv->recv_tasklet);
+		} else if (skb) {
+			/* MSG from LMAC, non-data*/
+			hal_event_recv++;
+			priv->rcv_handler(skb, LMAC_MOD_ID);
+		}
+	}
+
+	return done;
+}
+
+
+static void rx_tasklet_fn(unsigned long data)
+{
+	struct hal_priv *priv = (struct hal_priv *)data;
+
+	hal_hist_bh_start(priv);
+	hal_rx_process(priv, INT_MAX);
+
+	/* The event ring was full in the irq handler, fetch what the FW
+	 * still holds now that it is drained and unmask once it is empty
+	 */
+	if (priv->irq_masked && !READ_ONCE(priv->irq_stopping)) {
+		if (hal_fetch_event(priv) > 0) {
+			tasklet_schedule(&priv->rx_tasklet);
+		} else {
+			priv->irq_masked = 0;
+			enable_irq(priv->irq);
+		}
+	}
+
+	hal_rx_refill_flush(priv);
+	hal_rx_pool_adapt(priv);
+}
+
+
+static void hal_register_callback(msg_handler handler,
+				  unsigned char mod_id)
+{
+	hpriv->rcv_handler = handler;
+}
+
+
+static void hal_register_rx_filter(rx_filter_handler handler)
+{
+	hpriv->rx_filter = handler;
+}
+
+
+/* Called on reset complete with what the FW advertised */
+static void hal_request_rings(int event, int cmd)
+{
+	hal_event_ring_request(hpriv, event);
+
+	/* The command ring state belongs to the TX tasklet */
+	tasklet_disable(&hpriv->tx_tasklet);
+	hal_cmd_ring_request(hpriv, cmd);
+	tasklet_enable(&hpriv->tx_tasklet);
+}
+
+
+static int hal_event_pending(struct hal_priv *priv)
+{
+	unsigned int value;
+
+	if (priv->gram_event_ring)
+		return readl(&priv->gram_event_ring->head) !=
+			priv->gram_ring_tail;
+
+	value = readl((void __iomem *)(MTX_TO_HOST_CMD_ADDR)) &
+		0x7fffffff;
+
+	return value == (0x7fff0000 | priv->event_cnt);
+}
+
+
+static void hal_event_ack(struct hal_priv *priv)
+{
+	unsigned int value;
+
+	/* Status clears and the ring tail written to GRAM land first */
+	wmb();
+
+	/* Clear the uccp interrupt */
+	value = 0;
+	value |= BIT(MTX_INT_CLR_SHIFT);
+	writel(*((unsigned long   *)&(value)),
+	(void __iomem *)(HOST_TO_MTX_ACK_ADDR));
+}
+
+
+/* Ask the FW to post events to a ring, the answer is picked up after the
+ * next events in the single slot. Only done for a FW that advertises the
+ * ring, enable is 0 to go back to the single slot.
+ */
+static void hal_event_ring_request(struct hal_priv *priv, int enable)
+{
+	unsigned int entries = min_t(u32, event_ring,
+				     HAL_EVENT_RING_MAX_ENTRIES);
+
+	priv->gram_event_ring = NULL;
+	priv->gram_ring_entries = 0;
+	priv->gram_ring_tail = 0;
+	priv->gram_ring_pending = 0;
+
+	if (!enable || !entries)
+		return;
+
+	writel(0, (void __iomem *)HAL_GRAM_EVENT_RING_RSP);
+	writel(HAL_EVENT_RING_MAGIC | entries,
+	       (void __iomem *)HAL_GRAM_EVENT_RING_REQ);
+	priv->gram_ring_pending = entries;
+}
+
+
+static void hal_event_ring_check(struct hal_priv *priv)
+{
+	unsigned long offset, entries, size;
+	unsigned int requested = priv->gram_ring_pending;
+	struct hal_gram_event_ring __iomem *ring;
+
+	offset = readl((void __iomem *)HAL_GRAM_EVENT_RING_RSP);
+
+	if (!offset)
+		return;
+
+	priv->gram_ring_pending = 0;
+	entries = readl((void __iomem *)HAL_GRAM_EVENT_RING_RSP_ENTRIES);
+	size = sizeof(*ring) + entries * sizeof(ring->entry[0]);
+
+	if (!entries || entries > requested ||
+	    offset + size > priv->uccp_pkd_gram_len - priv->shm_offset) {
+		pr_err("%s: Invalid event ring offset: 0x%lx entries: %lu, using single slot\n",
+		       hal_name, offset, entries);
+		return;
+	}
+
+	ring = (struct hal_gram_event_ring __iomem *)(priv->gram_mem_addr +
+						       offset);
+	priv->gram_ring_tail = readl(&ring->tail);
+	priv->gram_ring_entries = entries;
+	priv->gram_event_ring = ring;
+
+	pr_info("%s: Event ring of %lu entries at 0x%lx\n",
+		hal_name, entries, offset);
+}
+
+
+/* Range check an event posted by the FW, translate its addresses to host
+ * addresses and post it to the event ring. Returns 0 on success, 1 if
+ * the event ring is full and -1 if the event is invalid.
+ */
+static int hal_event_post(struct hal_priv *priv,
+			  unsigned long event_addr,
+			  unsigned long event_status_addr,
+			  unsigned long event_len)
+{
+	/* Range check */
+	if (!(CHECK_EVENT_ADDR_UCCP(event_addr)) ||
+	    !(CHECK_EVENT_STATUS_ADDR_UCCP(event_status_addr)) ||
+	    !CHECK_EVENT_LEN(event_len)) {
+		pr_err("%s: Error!!! event_addr = 0x%08x\n",
+		       __func__,
+		       (unsigned int)event_addr);
+
+		pr_err("%s: Error!!! event_len =%d\n",
+		       __func__,
+		       (int)event_len);
+
+		pr_err("%s: Error!!! event_status_addr = 0x%08x\n",
+		       __func__,
+		       (unsigned int)event_status_addr);
+
+		/* If addr is valid try to clear */
+		if (CHECK_EVENT_STATUS_ADDR_UCCP(event_status_addr)) {
+			event_status_addr -= HAL_UCCP_GRAM_BASE;
+			event_status_addr += ((priv->gram_mem_addr) -
+					      (priv->shm_offset));
+			*((unsigned long *)event_status_addr) = 0;
+			wmb();
+		} else
+			pr_err("%s: UCCP status addr invalid, not clearing it\n",
+			       hal_name);
+
+		return -1;
+	}
+	UCCP_DEBUG_HAL("%s: event address = 0x%08x\n",
+		hal_name,
+		(unsigned int)event_addr);
+	UCCP_DEBUG_HAL("%s: event status address = 0x%08x\n",
+		hal_name,
+		(unsigned int)event_status_addr);
+	UCCP_DEBUG_HAL("%s: event len = %d\n",
+		hal_name,
+		(int)event_len);
+
+	event_addr -= HAL_UCCP_GRAM_BASE;
+	event_status_addr -= HAL_UCCP_GRAM_BASE;
+	event_addr += ((priv->gram_mem_addr) - (priv->shm_offset));
+	event_status_addr += ((priv->gram_mem_addr) -
+			      (priv->shm_offset));
+
+	if (hal_event_enqueue(priv, event_addr, event_status_addr,
+			      event_len))
+		return 1;
+
+	return 0;
+}
+
+
+/* Drain the GRAM event ring into the event ring with a single ack. Entries
+ * that do not fit are left to the FW ring for the next fetch, nothing is
+ * dropped. Returns the number of events queued, or -1 if none fit and the
+ * ring was not acked.
+ */
+static int hal_fetch_event_ring(struct hal_priv *priv)
+{
+	struct hal_gram_event_ring __iomem *ring = priv->gram_event_ring;
+	unsigned int head, tail, slot;
+	int cnt = 0;
+
+	head = readl(&ring->head);
+	tail = priv->gram_ring_tail;
+
+	/* Read the entries only after the head */
+	rmb();
+
+	while (tail != head) {
+		slot = tail % priv->gram_ring_entries;
+
+		if (hal_event_post(priv, readl(&ring->entry[slot].addr),
+				   readl(&ring->entry[slot].status_addr),
+				   readl(&ring->entry[slot].len)) > 0)
+			break;
+
+		tail++;
+		cnt++;
+	}
+
+	if (tail == priv->gram_ring_tail) {
+		if (tail != head) {
+			priv->event_ring_full++;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	priv->gram_ring_tail = tail;
+	writel(tail, &ring->tail);
+
+	hal_event_ack(priv);
+
+	return cnt;
+}
+
+
+/* Latch the events posted by the firmware in the GRAM event slot (or the
+ * negotiated event ring) into the event ring and ack the interrupt, no
+ * allocation or copy is done here.
+ * Returns 1 if events were queued, 0 if there is no event pending,
+ * -1 if the event slot has invalid contents and 2 if events are pending
+ * but our event ring is full, in which case the interrupt is not acked.
+ */
+static int hal_fetch_event(struct hal_priv *priv)
+{
+	unsigned long event_addr, event_status_addr, event_len;
+	int cnt = 1;
+	int ret;
+
+	if (!hal_event_pending(priv))
+		return 0;
+
+#ifdef CONFIG_PM
+	rx_interrupt_status = 1;
+#endif
+	if (priv->gram_event_ring) {
+		cnt = hal_fetch_event_ring(priv);
+
+		if (cnt < 0)
+			return 2;
+
+		if (!cnt)
+			return 0;
+
+		goto out;
+	}
+
+	event_addr = readl((void __iomem *)HAL_GRAM_EVENT_START);
+	event_status_addr = readl((void __iomem *)(HAL_GRAM_EVENT_START
+						   + 4));
+	event_len = readl((void __iomem *)(HAL_GRAM_EVENT_START + 8));
+
+	ret = hal_event_post(priv, event_addr, event_status_addr, event_len);
+
+	if (unlikely(ret < 0))
+		return -1;
+
+	/* Bottom half is behind, the event stays in the slot unacked till
+	 * it has drained the ring. A dropped event would leak the RX
+	 * buffers or TX token it carries.
+	 */
+	if (ret > 0) {
+		priv->event_ring_full++;
+		return 2;
+	}
+
+	priv->event_cnt++;
+
+	hal_event_ack(priv);
+
+	if (priv->gram_ring_pending)
+		hal_event_ring_check(priv);
+out:
+	/* The FW is responsive, retry pending commands straight away */
+	if (priv->cmd_wait_start ||
+	    (priv->gram_cmd_ring && !skb_queue_empty(&priv->txq)))
+		tasklet_schedule(&priv->tx_tasklet);
+
+	priv->events_fetched += cnt;
+
+	if (cnt > priv->events_fetch_max)
+		priv->events_fetch_max = cnt;
+
+	return 1;
+}
+
+
+/* Interrupt moderation
+ *
+ * Once a poll has drained all events the interrupt is normally unmasked
+ * straight away. With irq_holdoff_us set and at least irq_max_events
+ * handled since the interrupt was masked, it is kept masked for the
+ * holdoff instead and the next events are picked up by the timer. In
+ * adaptive mode the holdoff scales with the average events per interrupt,
+ * up to irq_holdoff_us at irq_max_events.
+ */
+static unsigned int hal_irq_holdoff_us(struct hal_priv *priv)
+{
+	unsigned int avg;
+
+	if (!irq_holdoff_us || !irq_max_events)
+		return 0;
+
+	if (!irq_adaptive)
+		return (priv->irq_events >= irq_max_events) ?
+			irq_holdoff_us : 0;
 
-				if (!new_skb) {
-					/* If allocation fails, drop the packet,
-					 * continue
-					 */
-					memcpy(rx_buf_info,
-					       &temp_rx_buf_info,
-					       sizeof(struct buf_info));
+	/* Average is kept in 1/16th of an event */
+	priv->irq_events_avg = (priv->irq_events_avg * 7 +
+				(priv->irq_events << 4)) / 8;
+	avg = min(priv->irq_events_avg >> 4, irq_max_events);
 
-					dma_map_single(NULL,
-						       rx_buf_info->src_ptr,
-						       max_data_size,
-						       DMA_FROM_DEVICE);
+	return (irq_holdoff_us * avg) / irq_max_events;
+}
 
-					dma_buf = rx_buf_info->dma_buf;
-				} else {
-					rx_skb = temp_rx_buf_info.skb;
 
-					if (temp_rx_buf_info.dma_buf_priv) {
-						memcpy(skb_put(rx_skb,
-						       data_length),
-						       src_ptr,
-						       data_length);
+static void hal_rx_schedule(struct hal_priv *priv)
+{
+	/* No thread yet (the irq is registered first) or any more */
+	struct task_struct *task = READ_ONCE(priv->rx_task);
 
-					} else {
-						skb_put(rx_skb, data_length);
-					}
+	if (priv->rx_thread && task) {
+		set_bit(0, &priv->rx_thread_kick);
+		wake_up_process(task);
+	} else
+		napi_schedule(&priv->napi);
+}
 
-					init_rx_buf(pkt_desc, max_data_size,
-						    &dma_buf, new_skb);
-					skb_queue_tail(&hpriv->refillq, rx_skb);
-				}
 
-				cmd_rx.rx_pkt_data.rx_pkt_cnt++;
-				cmd_rx.rx_pkt_data.rx_pkt[count].desc =
-					evnt->rx_pkt_desc[count];
-				cmd_rx.rx_pkt_data.rx_pkt[count].ptr =
-					dma_buf - uccp_ddr_base;
+static void hal_irq_unmask(struct hal_priv *priv)
+{
+	unsigned int holdoff = hal_irq_holdoff_us(priv);
 
-			}
+	if (READ_ONCE(priv->irq_stopping))
+		return;
 
-			if (cmd_rx.rx_pkt_data.rx_pkt_cnt != 0) {
-				cmd_rx.hdr.id = 0xffffffff;
+	if (holdoff) {
+		priv->irq_holdoffs++;
+		hrtimer_start(&priv->irq_timer,
+			      ktime_set(0, holdoff * NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+		return;
+	}
 
-				/* Inform HAL about the newly allocated
-				 * buffers
-				 */
-				nbuf = alloc_skb(sizeof(struct cmd_hal),
-						 GFP_ATOMIC);
-				if (nbuf) {
-					cmd_data = skb_put(nbuf,
-						   sizeof(struct cmd_hal));
-
-					memcpy(cmd_data,
-					       (unsigned char *)&cmd_rx,
-					       sizeof(struct cmd_hal));
-					hal_cmd_sent--;
-					hostport_send_head(hpriv, nbuf);
+	priv->irq_events = 0;
 
-				}
-			}
+	if (priv->irq_masked) {
+		priv->irq_masked = 0;
+		enable_irq(priv->irq);
+	}
+}
 
-#ifdef PERF_PROFILING
-			do_gettimeofday(&full_tv_now);
-
-			if ((full_tv_now.tv_sec - full_tv_start.tv_sec) == 0) {
-				full_usec_diff = full_tv_now.tv_usec -
-						 full_tv_start.tv_usec;
-			} else {
-				/* Exceeding the second */
-				full_usec_diff = full_tv_now.tv_usec +
-						 (((1000 * 1000) -
-						  full_tv_start.tv_usec) + 1);
-			}
 
-			spin_lock_irqsave(&timing_lock, pflags);
+static enum hrtimer_restart hal_irq_timer_fn(struct hrtimer *timer)
+{
+	struct hal_priv *priv = container_of(timer, struct hal_priv,
+					     irq_timer);
 
-			halint_event_handling_time[halint_handling_index] =
-			full_usec_diff;
+	/* Events posted during the holdoff are taken without an interrupt */
+	priv->irq_events = 0;
 
-			halint_handling_index = (halint_handling_index +
-						 1) % 20;
+	if (READ_ONCE(priv->irq_stopping))
+		return HRTIMER_NORESTART;
 
-			spin_unlock_irqrestore(&timing_lock, pflags);
+	if (!hal_event_ring_empty(priv) || hal_event_pending(priv)) {
+		hal_rx_schedule(priv);
+	} else if (priv->irq_masked) {
+		priv->irq_masked = 0;
+		enable_irq(priv->irq);
+	}
 
-			/* Start the Timer for RCV Handler Profiling */
-			do_gettimeofday(&tv_start);
-#endif
-			tasklet_schedule(&priv->recv_tasklet);
-#ifdef PERF_PROFILING
-			do_gettimeofday(&tv_now);
-
-			if ((tv_now.tv_sec - tv_start.tv_sec) == 0) {
-				usec_diff = tv_now.tv_usec - tv_start.tv_usec;
-			} else {
-				/* exceeding the second */
-				usec_diff = tv_now.tv_usec +
-					    (((1000 * 1000) -
-					      tv_start.tv_usec) + 1);
-			}
+	return HRTIMER_NORESTART;
+}
+
+
+static void rate_timer_expiry(unsigned long data)
+{
+	static unsigned int last_irq, last_frames;
+	static unsigned int last_bounce;
+	static unsigned long last_events, last_bytes;
+	struct hal_priv *priv = (struct hal_priv *)data;
+	unsigned int frames = priv->rx_zero_copy + priv->rx_copy;
 
-			spin_lock_irqsave(&timing_lock, pflags);
+	priv->irq_per_sec = priv->irq_count - last_irq;
+	priv->events_per_sec = rx_cnt - last_events;
+	priv->rx_frames_per_sec = frames - last_frames;
+	priv->rx_kbps = ((priv->rx_data_bytes - last_bytes) * 8) / 1000;
+	priv->tx_bounce_per_sec = priv->tx_bounce - last_bounce;
 
-			rcv_hdlr_time[rcv_hdlr_index] = usec_diff;
-			rcv_hdlr_index = (rcv_hdlr_index + 1)%20;
+	last_irq = priv->irq_count;
+	last_events = rx_cnt;
+	last_frames = frames;
+	last_bytes = priv->rx_data_bytes;
+	last_bounce = priv->tx_bounce;
 
-			spin_unlock_irqrestore(&timing_lock, pflags);
-#endif
-			/* Internal CMD, Free it */
-			dev_kfree_skb_any(skb);
+	mod_timer(&priv->rate_timer, jiffies + msecs_to_jiffies(1000));
+}
 
-		} else	{
-			/* MSG from LMAC, non-data*/
-			hal_event_recv++;
+
+/* Drain events and pass frames up against the budget, used by both the
+ * NAPI poll and the RX thread
+ */
+static int hal_rx_poll(struct hal_priv *priv, int budget)
+{
+	struct sk_buff *skb;
+	int work_done = 0;
+	int events;
+
+	while (work_done < budget) {
+		/* Buffers are already refilled, pass the frames UP */
+		skb = skb_dequeue(&priv->refillq);
+
+		if (skb) {
 			priv->rcv_handler(skb, LMAC_MOD_ID);
+			work_done++;
+			continue;
 		}
+
+		if (hal_event_ring_empty(priv) &&
+		    hal_fetch_event(priv) <= 0)
+			break;
+
+		events = hal_rx_process(priv, 1);
+		priv->irq_events += events;
+		work_done += events;
 	}
+
+	hal_rx_refill_flush(priv);
+	hal_rx_pool_adapt(priv);
+
+	return work_done;
 }
 
 
-static void hal_register_callback(msg_handler handler,
-				  unsigned char mod_id)
+static int hal_rx_napi_poll(struct napi_struct *napi, int budget)
 {
-	hpriv->rcv_handler = handler;
+	struct hal_priv *priv = container_of(napi, struct hal_priv, napi);
+	int work_done;
+
+	priv->rx_napi_polls++;
+	hal_hist_bh_start(priv);
+	priv->napi_ctx = napi;
+	work_done = hal_rx_poll(priv, budget);
+	priv->napi_ctx = NULL;
+
+	if (work_done >= budget) {
+		priv->rx_napi_budget_exhausted++;
+		return budget;
+	}
+
+	napi_complete(napi);
+	hal_irq_unmask(priv);
+
+	return work_done;
 }
 
 
-static irqreturn_t hal_irq_handler(int    irq, void  *p)
+static int hal_rx_thread_fn(void *data)
 {
+	struct hal_priv *priv = (struct hal_priv *)data;
+	int work_done;
 
-	unsigned int value;
-	unsigned long event_addr, event_status_addr, event_len;
-	unsigned char spurious;
-	struct sk_buff *skb;
-	struct hal_priv *priv = (struct hal_priv *)p;
-#ifdef PERF_PROFILING
-	long usec_diff;
-	struct timeval tv_start, tv_now;
-#endif
-	int is_err = 0;
-
-	spurious = 0;
+	for (;;) {
+		/* The stop flag and the kick are checked after the state is
+		 * set, a wake up from kthread_stop or the irq in between is
+		 * not lost
+		 */
+		set_current_state(TASK_INTERRUPTIBLE);
 
-	value = readl((void __iomem *)(MTX_TO_HOST_CMD_ADDR)) &
-		0x7fffffff;
-	if (value == (0x7fff0000 | priv->event_cnt)) {
-#ifdef PERF_PROFILING
-		do_gettimeofday(&tv_start);
-#endif
-#ifdef CONFIG_PM
-		rx_interrupt_status = 1;
-#endif
-		event_addr = readl((void __iomem *)HAL_GRAM_EVENT_START);
-		event_status_addr = readl((void __iomem *)(HAL_GRAM_EVENT_START
-							   + 4));
-		event_len = readl((void __iomem *)(HAL_GRAM_EVENT_START + 8));
-
-		/* Range check */
-		if (!(CHECK_EVENT_ADDR_UCCP(event_addr)) ||
-		    !(CHECK_EVENT_STATUS_ADDR_UCCP(event_status_addr)) ||
-		    !CHECK_EVENT_LEN(event_len)) {
-			pr_err("%s: Error!!! event_addr = 0x%08x\n",
-			       __func__,
-			       (unsigned int)event_addr);
-
-			pr_err("%s: Error!!! event_len =%d\n",
-			       __func__,
-			       (int)event_len);
-
-			pr_err("%s: Error!!! event_status_addr = 0x%08x\n",
-			       __func__,
-			       (unsigned int)event_status_addr);
-
-			is_err = 1;
+		if (kthread_should_stop()) {
+			__set_current_state(TASK_RUNNING);
+			break;
 		}
-		UCCP_DEBUG_HAL("%s: event address = 0x%08x\n",
-			hal_name,
-			(unsigned int)event_addr);
-		UCCP_DEBUG_HAL("%s: event status address = 0x%08x\n",
-			hal_name,
-			(unsigned int)event_status_addr);
-		UCCP_DEBUG_HAL("%s: event len = %d\n",
-			hal_name,
-			(int)event_len);
-
-		if (unlikely(is_err)) {
-			/* If addr is valid try to clear */
-			if (CHECK_EVENT_STATUS_ADDR_UCCP(event_status_addr)) {
-				event_status_addr -= HAL_UCCP_GRAM_BASE;
-				event_status_addr += ((priv->gram_mem_addr) -
-						      (priv->shm_offset));
-				*((unsigned long *)event_status_addr) = 0;
-			} else
-				pr_err("%s: UCCP status addr invalid, not clearing it\n",
-				       hal_name);
-
-			return IRQ_HANDLED;
+
+		if (!test_and_clear_bit(0, &priv->rx_thread_kick)) {
+			schedule();
+			continue;
 		}
 
-		event_addr -= HAL_UCCP_GRAM_BASE;
-		event_status_addr -= HAL_UCCP_GRAM_BASE;
-		event_addr += ((priv->gram_mem_addr) - (priv->shm_offset));
-		event_status_addr += ((priv->gram_mem_addr) -
-				      (priv->shm_offset));
+		__set_current_state(TASK_RUNNING);
 
-		skb = dev_alloc_skb(event_len);
+		mutex_lock(&priv->rx_thread_lock);
 
-		if (!skb) {
-			*((unsigned long *)event_status_addr) = 0;
-		} else {
-			*(unsigned long *)(skb->cb) = event_addr;
+		/* mac80211 RX and the TX done path expect BHs disabled */
+		local_bh_disable();
+		hal_hist_bh_start(priv);
+		work_done = hal_rx_poll(priv, HAL_NAPI_WEIGHT);
 
-			/* Address of event payload */
-			*(unsigned long *)(skb->cb + 4) = event_status_addr;
+		/* The irq stays masked till all events are drained */
+		if (work_done >= HAL_NAPI_WEIGHT)
+			set_bit(0, &priv->rx_thread_kick);
+		else
+			hal_irq_unmask(priv);
+		local_bh_enable();
 
-			/* Address to mark free */
-			*(unsigned long *)(skb->cb + 8) = event_len;
+		mutex_unlock(&priv->rx_thread_lock);
 
-			/* Length of event payload */
-			skb_queue_tail(&priv->rxq, skb);
-			tasklet_schedule(&priv->rx_tasklet);
-		}
+		cond_resched();
+	}
 
-		priv->event_cnt++;
-	} else {
-		spurious = 1;
+	return 0;
+}
+
+
+static int hal_rx_thread_init(struct hal_priv *priv)
+{
+	struct sched_param param;
+
+	priv->rx_task = kthread_create(hal_rx_thread_fn, priv, "uccp420_rx");
+
+	if (IS_ERR(priv->rx_task)) {
+		pr_err("%s: Unable to create RX thread\n", hal_name);
+		priv->rx_task = NULL;
+		return -1;
 	}
 
-	if (!spurious) {
-		/* Clear the uccp interrupt */
-		value = 0;
-		value |= BIT(MTX_INT_CLR_SHIFT);
-		writel(*((unsigned long   *)&(value)),
-		(void __iomem *)(HOST_TO_MTX_ACK_ADDR));
-	} else {
-		pr_warn("%s: Spurious interrupt received\n", hal_name);
+	if (!cpumask_empty(&priv->rx_thread_cpus)) {
+		set_cpus_allowed_ptr(priv->rx_task, &priv->rx_thread_cpus);
+		irq_set_affinity_hint(priv->irq, &priv->rx_thread_cpus);
+	}
 
+	if (priv->rx_thread_prio) {
+		param.sched_priority = min_t(unsigned int,
+					     priv->rx_thread_prio,
+					     MAX_USER_RT_PRIO - 1);
+		sched_setscheduler(priv->rx_task, SCHED_FIFO, &param);
 	}
 
-#ifdef PERF_PROFILING
-	do_gettimeofday(&tv_now);
+	wake_up_process(priv->rx_task);
+
+	return 0;
+}
 
-	if ((tv_now.tv_sec - tv_start.tv_sec) == 0) {
-		usec_diff = tv_now.tv_usec - tv_start.tv_usec;
+
+static irqreturn_t hal_irq_handler(int    irq, void  *p)
+{
+	struct hal_priv *priv = (struct hal_priv *)p;
+	u64 start = ktime_get_ns();
+
+	priv->irq_count++;
+
+	if (priv->rx_napi || priv->rx_thread) {
+		/* Keep the line masked till the poll drains all events */
+		if (hal_event_pending(priv)) {
+			disable_irq_nosync(irq);
+			priv->irq_masked = 1;
+			priv->irq_ts = (u32)start;
+			hal_rx_schedule(priv);
+		} else {
+			pr_warn("%s: Spurious interrupt received\n", hal_name);
+		}
 	} else {
-		/* Exceeding the second */
-		usec_diff = tv_now.tv_usec +
-			    (((1000 * 1000) - tv_start.tv_usec) + 1);
+		switch (hal_fetch_event(priv)) {
+		case 1:
+			priv->irq_ts = (u32)start;
+			tasklet_schedule(&priv->rx_tasklet);
+			break;
+		case 2:
+			/* Not acked, masked till the tasklet has made room */
+			disable_irq_nosync(irq);
+			priv->irq_masked = 1;
+			priv->irq_ts = (u32)start;
+			tasklet_schedule(&priv->rx_tasklet);
+			break;
+		case 0:
+			pr_warn("%s: Spurious interrupt received\n", hal_name);
+			break;
+		default:
+			break;
+		}
 	}
 
-	spin_lock_irqsave(&timing_lock, pflags);
-
-	irq_timestamp[irq_ts_index] = usec_diff;
-	irq_ts_index = (irq_ts_index + 1)%20;
+	hal_hist_add(HAL_HIST_IRQ, ktime_get_ns() - start);
 
-	spin_unlock_irqrestore(&timing_lock, pflags);
-#endif
 	return IRQ_HANDLED;
 }
 
@@ -978,36 +2043,6 @@ static void hal_disable_int(void  *p)
 }
 
 
-#ifdef PERF_PROFILING
-static int ulong_cmp(const void *a, const void *b)
-{
-	return *(unsigned long *)a - *(unsigned long *)b;
-}
-
-
-static int avg_array(unsigned long *arr, unsigned int max_index)
-{
-	unsigned int index;
-	unsigned int avg = 0;
-
-	if (!max_index)
-		return 0;
-
-	for (index = 0; index < max_index; index++)
-		avg += arr[index];
-
-	return avg/max_index;
-}
-
-
-static int max_array(unsigned long *arr, unsigned int max_index)
-{
-	sort(arr, max_index, sizeof(unsigned long), ulong_cmp, NULL);
-	return arr[max_index-1];
-}
-#endif
-
-
 static int proc_write_hal_stats(struct file          *file,
 		const char __user    *buffer,
 		size_t		     count,
@@ -1031,53 +2066,22 @@ static int proc_write_hal_stats(struct file          *file,
 		hal_get_dump_perip(&val);
 	else if (param_get_val(buf, "get_sysbus_dump=", &val))
 		hal_get_dump_sysbus(&val);
+	else if (param_get_val(buf, "rx_refill_lowat=", &val))
+		rx_refill_lowat = val;
+	else if (param_get_val(buf, "irq_holdoff_us=", &val))
+		irq_holdoff_us = val;
+	else if (param_get_val(buf, "irq_max_events=", &val))
+		irq_max_events = val;
+	else if (param_get_val(buf, "irq_adaptive=", &val))
+		irq_adaptive = !!val;
+	else if (param_get_val(buf, "cmd_spin_us=", &val))
+		cmd_spin_us = val;
 	return count;
 }
 
 static int proc_read_hal_stats(struct seq_file *m, void *v)
 {
-#ifdef PERF_PROFILING
-	int index, max_index = 20;
-
-	seq_puts(m, "************* Host HAL Stats ***********\n");
-
-	seq_printf(m, "IRQ TIME: AVG: %d, MAX: %d\n",
-		   avg_array(irq_timestamp, 20),
-		   max_array(irq_timestamp, 20));
-
-	for (index = 0; index < max_index; index++)
-		seq_printf(m, "IRQ[%d] = %ld\n",
-			   index,
-			   irq_timestamp[index]);
-
-	seq_printf(m, "RCV Handler TIME: AVG: %d, MAX: %d\n",
-		   avg_array(rcv_hdlr_time, 20),
-		   max_array(rcv_hdlr_time, 20));
-
-	for (index = 0; index < max_index; index++)
-		seq_printf(m, "RH[%d] = %ld\n",
-			   index,
-			   rcv_hdlr_time[index]);
-
-	seq_printf(m, "Packetx Rx with HAL Internal: AVG: %d, MAX: %d\n",
-		   avg_array(rx_pkts_halint_event, 20),
-		   max_array(rx_pkts_halint_event, 20));
-
-	for (index = 0; index < max_index; index++)
-		seq_printf(m, "RXPKT[%d] = %ld\n",
-			   index,
-			   rx_pkts_halint_event[index]);
-
-	seq_printf(m, "HAL Internal Event Handling Time: AVG: %d, MAX: %d\n",
-		   avg_array(halint_event_handling_time, 20),
-		   max_array(halint_event_handling_time, 20));
-
-	for (index = 0; index < max_index; index++)
-		seq_printf(m, "HALINT[%d] = %ld\n",
-			   index,
-			   halint_event_handling_time[index]);
-
-#endif
+	int index;
 
 	seq_printf(m, "Alloc SKB Failures: %d\n",
 		   alloc_skb_failures);
@@ -1093,12 +2097,132 @@ static int proc_read_hal_stats(struct seq_file *m, void *v)
 
 	seq_printf(m, "Alloc SKB Run time: %d\n", alloc_skb_priv_runtime);
 
+	seq_printf(m, "RX zero copy frames: %d\n", hpriv->rx_zero_copy);
+
+	seq_printf(m, "RX copied frames: %d\n", hpriv->rx_copy);
+
+	seq_printf(m, "RX pool pages 2K: %d/%d 12K: %d/%d (%ld KB of %d KB)\n",
+		   hpriv->rx_pool_2k.num_pages,
+		   hpriv->rx_pool_2k.target_pages,
+		   hpriv->rx_pool_12k.num_pages,
+		   hpriv->rx_pool_12k.target_pages,
+		   ((hpriv->rx_pool_2k.num_pages <<
+		     hpriv->rx_pool_2k.order) +
+		    (hpriv->rx_pool_12k.num_pages <<
+		     hpriv->rx_pool_12k.order)) * (PAGE_SIZE / 1024),
+		   HAL_HOST_BOUNCE_BUF_LEN / 1024);
+
+	seq_puts(m, "RX frame size histogram:\n");
+
+	for (index = 0; index < HAL_RX_HIST_BINS - 1; index++)
+		seq_printf(m, "  < %d: %d\n", 256 << index,
+			   hpriv->rx_len_hist[index]);
+
+	seq_printf(m, "  >= %d: %d\n", 128 << index,
+		   hpriv->rx_len_hist[index]);
+
+	seq_printf(m, "RX pool recycled: %d\n", hpriv->rx_pool_recycled);
+
+	seq_printf(m, "RX pool miss: %d\n", hpriv->rx_pool_miss);
+
 	seq_printf(m, "hal_cmd_sent_cnt: %d\n",
 		   hal_cmd_sent);
 
 	seq_printf(m, "hal_event_recv_cnt: %d\n",
 		   hal_event_recv);
 
+	seq_printf(m, "rx_refill_cmds: %d\n",
+		   hpriv->rx_refill_cmds);
+
+	seq_printf(m, "rx_refill_bufs: %d\n",
+		   hpriv->rx_refill_bufs);
+
+	seq_printf(m, "rx_refill_lowat: %d\n",
+		   rx_refill_lowat);
+
+	seq_printf(m, "rx_bufs_with_fw: %d (12K: %d)\n",
+		   hpriv->rx_bufs_fw, hpriv->rx_bufs_12k_fw);
+
+	seq_printf(m, "cmd_spin_us: %d cmd_spin_total_us: %llu\n",
+		   cmd_spin_us, div_u64(hpriv->cmd_spin_ns, NSEC_PER_USEC));
+
+	seq_printf(m, "cmd_slot_waits: %d cmd_timeouts: %d cmd_retries: %d\n",
+		   hpriv->cmd_slot_waits, hpriv->cmd_timeouts,
+		   hpriv->cmd_retries);
+
+	if (hpriv->gram_cmd_ring)
+		seq_printf(m, "Command mode: ring entries: %d\n",
+			   hpriv->cmd_ring_entries);
+	else
+		seq_printf(m, "Command mode: single slot\n");
+
+	seq_printf(m, "GRAM writes: %s\n",
+		   (gram_wc && hpriv->gram_wc_base_addr) ?
+		   "write-combined" : "uncached");
+
+	seq_printf(m, "cmd_doorbells: %d cmds_per_doorbell: %d\n",
+		   hpriv->cmd_doorbells,
+		   hpriv->cmd_doorbells ?
+		   hal_cmd_sent / hpriv->cmd_doorbells : 0);
+
+	seq_printf(m, "cmd_pool_hits: %d cmd_pool_miss: %d\n",
+		   hpriv->cmd_pool_hits, hpriv->cmd_pool_miss);
+
+	seq_printf(m, "rx_filter_drops: %d\n",
+		   hpriv->rx_filter_drops);
+
+	seq_printf(m, "event_ring_full: %d\n",
+		   hpriv->event_ring_full);
+
+	seq_printf(m, "event_skb_allocs: %d\n",
+		   hpriv->event_skb_allocs);
+	seq_printf(m, "event_inplace: %d\n",
+		   hpriv->event_inplace);
+
+	seq_printf(m, "irq_holdoff_us: %d irq_max_events: %d irq_adaptive: %d\n",
+		   irq_holdoff_us, irq_max_events, irq_adaptive);
+
+	seq_printf(m, "hal_irq_cnt: %d irq_holdoffs: %d\n",
+		   hpriv->irq_count, hpriv->irq_holdoffs);
+
+	if (hpriv->gram_event_ring)
+		seq_printf(m, "Event mode: ring entries: %d\n",
+			   hpriv->gram_ring_entries);
+	else
+		seq_printf(m, "Event mode: single slot\n");
+
+	seq_printf(m, "events_per_irq: %d events_per_fetch_max: %d\n",
+		   hpriv->irq_count ?
+		   hpriv->events_fetched / hpriv->irq_count : 0,
+		   hpriv->events_fetch_max);
+
+	seq_printf(m, "IRQ/s: %d Events/s: %d RX frames/s: %d RX kbps: %d\n",
+		   hpriv->irq_per_sec, hpriv->events_per_sec,
+		   hpriv->rx_frames_per_sec, hpriv->rx_kbps);
+
+	seq_printf(m, "tx_bounce: %d TX bounces/s: %d\n",
+		   hpriv->tx_bounce, hpriv->tx_bounce_per_sec);
+
+	seq_printf(m, "tx_data_writes: %d tx_data_bytes_per_write: %lu tx_data_skipped: %d\n",
+		   hpriv->tx_data_writes,
+		   hpriv->tx_data_writes ?
+		   hpriv->tx_data_bytes / hpriv->tx_data_writes : 0,
+		   hpriv->tx_data_skipped);
+
+	if (hpriv->rx_thread)
+		seq_printf(m, "RX mode: thread prio: %d cpus: %*pbl\n",
+			   hpriv->rx_thread_prio,
+			   cpumask_pr_args(&hpriv->rx_thread_cpus));
+	else
+		seq_printf(m, "RX mode: %s\n",
+			   hpriv->rx_napi ? "NAPI" : "tasklet");
+
+	seq_printf(m, "rx_napi_polls: %d\n",
+		   hpriv->rx_napi_polls);
+
+	seq_printf(m, "rx_napi_budget_exhausted: %d\n",
+		   hpriv->rx_napi_budget_exhausted);
+
 	return 0;
 }
 
@@ -1118,6 +2242,132 @@ static const struct file_operations params_fops_hal_stats = {
 };
 
 
+static const char * const hal_hist_names[HAL_HIST_MAX] = {
+	"irq_ns",
+	"irq_to_bh_ns",
+	"rx_event_ns",
+	"rx_pkt_cnt",
+	"cmd_wait_ns",
+	"cmd_batch",
+	"tx_map_ns",
+	"tx_unmap_ns",
+	"cmd_post_ns",
+};
+
+
+/* Upper bound of the bucket holding the pct percentile, capped at max */
+static u64 hal_hist_pct(struct hal_hist *hist, u64 total, unsigned int pct)
+{
+	u64 sum = 0;
+	int bucket;
+
+	for (bucket = 0; bucket < HAL_HIST_BUCKETS - 1; bucket++) {
+		sum += hist->cnt[bucket];
+
+		if (sum * 100 >= total * pct)
+			return min_t(u64, (1ULL << bucket) - 1, hist->max);
+	}
+
+	return hist->max;
+}
+
+
+static int hal_hist_show(struct seq_file *m, void *v)
+{
+	struct hal_hist sum;
+	struct hal_hist *hist;
+	u64 total;
+	int id, cpu, bucket;
+
+	for (id = 0; id < HAL_HIST_MAX; id++) {
+		memset(&sum, 0, sizeof(sum));
+
+		for_each_possible_cpu(cpu) {
+			hist = &per_cpu(hal_hist_cpu, cpu).hist[id];
+
+			for (bucket = 0; bucket < HAL_HIST_BUCKETS; bucket++)
+				sum.cnt[bucket] += hist->cnt[bucket];
+
+			if (hist->max > sum.max)
+				sum.max = hist->max;
+		}
+
+		total = 0;
+
+		for (bucket = 0; bucket < HAL_HIST_BUCKETS; bucket++)
+			total += sum.cnt[bucket];
+
+		seq_printf(m, "%s: samples: %llu p50: %llu p99: %llu max: %llu\n",
+			   hal_hist_names[id], total,
+			   total ? hal_hist_pct(&sum, total, 50) : 0,
+			   total ? hal_hist_pct(&sum, total, 99) : 0,
+			   sum.max);
+
+		for (bucket = 0; bucket < HAL_HIST_BUCKETS; bucket++) {
+			if (!sum.cnt[bucket])
+				continue;
+
+			seq_printf(m, "  < %llu: %u\n", 1ULL << bucket,
+				   sum.cnt[bucket]);
+		}
+	}
+
+	return 0;
+}
+
+
+/* Any write clears the histograms */
+static ssize_t hal_hist_write(struct file *file,
+			      const char __user *buffer,
+			      size_t count,
+			      loff_t *ppos)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(&per_cpu(hal_hist_cpu, cpu), 0,
+		       sizeof(struct hal_hist_cpu));
+
+	return count;
+}
+
+
+static int hal_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hal_hist_show, NULL);
+}
+
+
+static const struct file_operations hal_hist_fops = {
+	.open = hal_hist_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.write = hal_hist_write,
+	.release = single_release
+};
+
+
+static void hal_debugfs_init(void)
+{
+	hal_debugfs_dir = debugfs_create_dir("uccp420wlan", NULL);
+
+	if (IS_ERR_OR_NULL(hal_debugfs_dir)) {
+		pr_warn("%s: debugfs not available\n", hal_name);
+		hal_debugfs_dir = NULL;
+		return;
+	}
+
+	debugfs_create_file("hal_latency", 0644, hal_debugfs_dir, NULL,
+			    &hal_hist_fops);
+	debugfs_create_u32("gram_wc", 0644, hal_debugfs_dir, &gram_wc);
+	debugfs_create_u32("tx_map_batch", 0644, hal_debugfs_dir,
+			   &tx_map_batch);
+	debugfs_create_u32("rx_napi", 0644, hal_debugfs_dir, &rx_napi);
+	debugfs_create_u32("event_ring", 0644, hal_debugfs_dir, &event_ring);
+	debugfs_create_u32("cmd_ring", 0644, hal_debugfs_dir, &cmd_ring);
+}
+
+
 static int hal_proc_init(struct proc_dir_entry *hal_proc_dir_entry)
 {
 	struct proc_dir_entry *entry;
@@ -1181,6 +2431,12 @@ int hal_start(void)
 #endif
 	hpriv->hal_disabled = 0;
 
+	/* The irq is off till hal_enable_int, safe to switch the RX mode */
+	if (!hpriv->rx_thread)
+		hpriv->rx_napi = !!rx_napi;
+
+	mod_timer(&hpriv->rate_timer, jiffies + msecs_to_jiffies(1000));
+
 	/* Enable host_int and uccp_int */
 	hal_enable_int(NULL);
 
@@ -1192,6 +2448,7 @@ int hal_stop(void)
 {
 	/* Disable host_int and uccp_irq */
 	hal_disable_int(NULL);
+	del_timer_sync(&hpriv->rate_timer);
 	return 0;
 }
 
@@ -1270,6 +2527,8 @@ static int cleanup_all_resources(void)
 		release_mem_region(hpriv->uccp_gram_base,
 				   hpriv->uccp_gram_len);
 	}
+	if (hpriv->gram_wc_base_addr)
+		iounmap((void __iomem *)hpriv->gram_wc_base_addr);
 	iounmap((void __iomem *)hpriv->gram_base_addr);
 	release_mem_region(hpriv->uccp_pkd_gram_base,
 			   hpriv->uccp_pkd_gram_len);
@@ -1281,6 +2540,7 @@ static int cleanup_all_resources(void)
 	/* Free UCCP HAL TX data */
 	kfree(hpriv->hal_tx_data);
 	hpriv->hal_tx_data = NULL;
+	hpriv->hal_tx_data_gram = NULL;
 
 	/* Free private structure */
 	kfree(hpriv);
@@ -1296,6 +2556,7 @@ static int uccp420_pltfr_probe(struct platform_device *pdev)
 	struct device_node *np = pdev->dev.of_node;
 	struct property *pp = NULL;
 	struct iio_channel *channels;
+	const char *cpus;
 	int ret;
 	int size;
 
@@ -1381,6 +2642,14 @@ static int uccp420_pltfr_probe(struct platform_device *pdev)
 	if (pp && pp->value)
 		num_streams_vpd = *((int *)pp->value);
 
+	/* Optional dedicated RX thread, overrides rx_napi */
+	hpriv->rx_thread = of_property_read_bool(np, "rx-thread");
+	of_property_read_u32(np, "rx-thread-priority", &hpriv->rx_thread_prio);
+
+	if (!of_property_read_string(np, "rx-thread-cpus", &cpus) &&
+	    cpulist_parse(cpus, &hpriv->rx_thread_cpus))
+		pr_err("%s: Invalid rx-thread-cpus %s\n", hal_name, cpus);
+
 	clk_prepare_enable(devm_clk_get(&pdev->dev, "rpu_core"));
 	clk_prepare_enable(devm_clk_get(&pdev->dev, "rpu_l"));
 	clk_prepare_enable(devm_clk_get(&pdev->dev, "rpu_v"));
@@ -1477,26 +2746,55 @@ static int hal_update_axd_timestamps(void)
 static int hal_deinit(void *dev)
 {
 	struct sk_buff *skb;
+	int i;
 
 	(void)(dev);
 
+	debugfs_remove_recursive(hal_debugfs_dir);
+	hal_debugfs_dir = NULL;
+
 	_uccp420wlan_80211if_exit();
 	platform_driver_unregister(&img_uccp_driver);
 
+	/* Stop the NAPI poll and RX thread before the irq line goes away,
+	 * a poll still running may unmask or arm the holdoff timer till
+	 * then, so the timer is only cancelled once both are stopped
+	 */
+	WRITE_ONCE(hpriv->irq_stopping, 1);
+	napi_disable(&hpriv->napi);
+
+	if (hpriv->rx_task) {
+		struct task_struct *task = hpriv->rx_task;
+
+		/* From here the irq falls back to the (stopped) NAPI poll,
+		 * wait for a handler that may still be waking the thread
+		 */
+		WRITE_ONCE(hpriv->rx_task, NULL);
+		synchronize_irq(hpriv->irq);
+		kthread_stop(task);
+		irq_set_affinity_hint(hpriv->irq, NULL);
+	}
+
+	hrtimer_cancel(&hpriv->irq_timer);
+	netif_napi_del(&hpriv->napi);
+
 	/* Free irq line */
 	chg_irq_register(0);
 
 	/* Kill the HAL tasklet */
+	hrtimer_cancel(&hpriv->cmd_timer);
 	tasklet_kill(&hpriv->tx_tasklet);
 	tasklet_kill(&hpriv->rx_tasklet);
 	tasklet_kill(&hpriv->recv_tasklet);
-	while ((skb = skb_dequeue(&hpriv->rxq)))
-		dev_kfree_skb_any(skb);
+	while ((skb = skb_dequeue(&hpriv->txq)))
+		hal_cmd_buf_put(hpriv, skb);
 
-	while ((skb = skb_dequeue(&hpriv->refillq)))
-		dev_kfree_skb_any(skb);
+	for (i = 0; i < HAL_CMD_POOL_SIZE; i++) {
+		if (hpriv->cmd_pool[i])
+			dev_kfree_skb_any(hpriv->cmd_pool[i]);
+	}
 
-	while ((skb = skb_dequeue(&hpriv->txq)))
+	while ((skb = skb_dequeue(&hpriv->refillq)))
 		dev_kfree_skb_any(skb);
 
 	cleanup_all_resources();
@@ -1511,10 +2809,12 @@ static int hal_init(void *dev)
 	int err = 0;
 	unsigned int value = 0;
 	unsigned char *rpusocwrap;
+	int i;
 
 	(void) (dev);
 
 	hpriv->shm_offset =  shm_offset;
+	hpriv->rx_napi = rx_napi && !hpriv->rx_thread;
 
 	if (hpriv->shm_offset != HAL_SHARED_MEM_OFFSET)
 		UCCP_DEBUG_HAL("%s: Using shared memory offset 0x%lx\n",
@@ -1587,6 +2887,29 @@ static int hal_init(void *dev)
 
 	hpriv->gram_mem_addr = hpriv->gram_base_addr + hpriv->shm_offset;
 
+	/* Commands and TX data are bulk copies, with write combining they
+	 * go out as bursts. Only the area from the TX data on is mapped WC,
+	 * the command and event slots, the rings and the status words are
+	 * always accessed through the uncached mapping.
+	 */
+	hpriv->gram_wc_base_addr = 0;
+	hpriv->gram_wc_start = HAL_GRAM_TX_DATA_START;
+	hpriv->gram_wc_len = 0;
+
+	if (hpriv->uccp_pkd_gram_len > hpriv->shm_offset + HAL_TX_DATA_OFFSET)
+		hpriv->gram_wc_len = hpriv->uccp_pkd_gram_len -
+				     hpriv->shm_offset - HAL_TX_DATA_OFFSET;
+
+	if (hpriv->gram_wc_len)
+		hpriv->gram_wc_base_addr =
+			(unsigned long)ioremap_wc(hpriv->uccp_pkd_gram_base +
+						  hpriv->shm_offset +
+						  HAL_TX_DATA_OFFSET,
+						  hpriv->gram_wc_len);
+	if (!hpriv->gram_wc_base_addr)
+		pr_err("%s: WC ioremap failed for gram region, using uncached\n",
+		       hal_name);
+
 	/* Try GFP_DMA, to get the buffer in ZONE_DMA.
 	 */
 	hpriv->base_addr_uccp_host_ram = kmalloc(HAL_HOST_BOUNCE_BUF_LEN,
@@ -1655,7 +2978,7 @@ static int hal_init(void *dev)
 	}
 
 	/*Allocate space do update data pointers to DCP*/
-	hpriv->hal_tx_data = kzalloc((NUM_TX_DESC * NUM_FRAMES_IN_TX_DESC *
+	hpriv->hal_tx_data = kzalloc((2 * NUM_TX_DESC * NUM_FRAMES_IN_TX_DESC *
 				      sizeof(struct hal_tx_data)), GFP_KERNEL);
 
 	if (!hpriv->hal_tx_data) {
@@ -1665,6 +2988,11 @@ static int hal_init(void *dev)
 		goto uccp_gram_b4_unmap;
 	}
 
+	/* The GRAM copy follows, it never matches until written */
+	hpriv->hal_tx_data_gram = hpriv->hal_tx_data +
+				  (NUM_TX_DESC * NUM_FRAMES_IN_TX_DESC);
+	memset(hpriv->hal_tx_data_gram, 0xff, NUM_TX_DESC * TX_DESC_HAL_SIZE);
+
 	/* Intialize HAL tasklets */
 	tasklet_init(&hpriv->tx_tasklet,
 		     tx_tasklet_fn,
@@ -1675,12 +3003,35 @@ static int hal_init(void *dev)
 	tasklet_init(&hpriv->recv_tasklet,
 		     recv_tasklet_fn,
 		     (unsigned long)hpriv);
-	skb_queue_head_init(&hpriv->rxq);
 	skb_queue_head_init(&hpriv->txq);
 	skb_queue_head_init(&hpriv->refillq);
-#ifdef PERF_PROFILING
-	spin_lock_init(&timing_lock);
-#endif
+
+	/* Command buffers, failures here fall back to allocation per cmd */
+	for (i = 0; i < HAL_CMD_POOL_SIZE; i++)
+		hpriv->cmd_pool[i] = alloc_skb(HAL_CMD_BUF_SIZE, GFP_KERNEL);
+
+	/* NAPI needs a netdev, mac80211 does not expose one to us */
+	init_dummy_netdev(&hpriv->napi_dev);
+	netif_napi_add(&hpriv->napi_dev, &hpriv->napi, hal_rx_napi_poll,
+		       HAL_NAPI_WEIGHT);
+	napi_enable(&hpriv->napi);
+	hpriv->irq_stopping = 0;
+	hrtimer_init(&hpriv->irq_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	hpriv->irq_timer.function = hal_irq_timer_fn;
+	hrtimer_init(&hpriv->cmd_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	hpriv->cmd_timer.function = hal_cmd_timer_fn;
+
+	init_timer(&hpriv->rate_timer);
+	hpriv->rate_timer.function = rate_timer_expiry;
+	hpriv->rate_timer.data = (unsigned long)hpriv;
+
+	mutex_init(&hpriv->rx_thread_lock);
+
+	if (hpriv->rx_thread && hal_rx_thread_init(hpriv)) {
+		/* Fall back to NAPI */
+		hpriv->rx_thread = 0;
+		hpriv->rx_napi = 1;
+	}
 
 	if (_uccp420wlan_80211if_init(&main_dir_entry) < 0) {
 		pr_err("%s: wlan_init failed\n", hal_name);
@@ -1693,6 +3044,8 @@ static int hal_init(void *dev)
 	if (err)
 		return err;
 
+	hal_debugfs_init();
+
 	hpriv->cmd_cnt = COMMAND_START_MAGIC;
 	hpriv->event_cnt = 0;
 
@@ -1709,6 +3062,8 @@ free_host_ram:
 	kfree(hpriv->base_addr_uccp_host_ram);
 	hpriv->base_addr_uccp_host_ram = NULL;
 uccp_gram_unmap:
+	if (hpriv->gram_wc_base_addr)
+		iounmap((void __iomem *)hpriv->gram_wc_base_addr);
 	iounmap((void __iomem *)hpriv->gram_base_addr);
 uccp_gram_pkd_release:
 	release_mem_region(hpriv->uccp_pkd_gram_base,
@@ -1730,6 +3085,340 @@ free_hpriv:
 	return err;
 }
 
+/* RX page pool
+ *
+ * The RPU can only DMA into the 64MB window around the bounce buffer, any
+ * RX skb outside of it is backed by the private area and the frame has to
+ * be copied out on every receive. The pool holds pages from the same zone
+ * as the bounce buffer (checked against the window), wraps them with
+ * build_skb and keeps an extra page reference, so the page comes back to
+ * the pool once the stack frees the skb.
+ */
+/* Add or drop pages to move the pool towards its target size, at most
+ * max_step pages per call. Returns the number of pages changed.
+ */
+static unsigned int hal_rx_pool_resize(struct hal_rx_pool *pool,
+				       gfp_t gfp,
+				       unsigned int max_step)
+{
+	struct page *page;
+	unsigned int step = 0;
+
+	while (pool->num_pages < pool->target_pages && step < max_step) {
+		page = alloc_pages(gfp | GFP_DMA | __GFP_COMP | __GFP_NOWARN,
+				   pool->order);
+
+		if (!page)
+			break;
+
+		if (!is_mem_dma(page_address(page),
+				PAGE_SIZE << pool->order)) {
+			/* Zone is bigger than the window, no point trying */
+			__free_pages(page, pool->order);
+			pool->target_pages = pool->num_pages;
+			break;
+		}
+
+		__clear_bit(pool->num_pages, pool->used);
+		pool->pages[pool->num_pages++] = page;
+		step++;
+	}
+
+	while (pool->num_pages > pool->target_pages && step < max_step) {
+		/* Pages still held by the stack are freed along with the skb */
+		put_page(pool->pages[--pool->num_pages]);
+		step++;
+	}
+
+	if (pool->next >= pool->num_pages)
+		pool->next = 0;
+
+	return step;
+}
+
+
+static int hal_rx_pool_init(struct hal_rx_pool *pool,
+			    unsigned int num_pages,
+			    unsigned int max_data_size)
+{
+	unsigned int size;
+
+	size = SKB_DATA_ALIGN(max_data_size) +
+	       SKB_DATA_ALIGN(sizeof(struct skb_shared_info));
+
+	pool->order = get_order(size);
+	pool->num_pages = 0;
+	pool->next = 0;
+
+	/* Room for the whole budget, the split changes at run time */
+	pool->max_pages = HAL_HOST_BOUNCE_BUF_LEN / (PAGE_SIZE << pool->order);
+	pool->target_pages = min(num_pages, pool->max_pages);
+	pool->pages = kcalloc(pool->max_pages, sizeof(struct page *),
+			      GFP_KERNEL);
+	pool->used = kcalloc(BITS_TO_LONGS(pool->max_pages),
+			     sizeof(unsigned long), GFP_KERNEL);
+
+	if (!pool->pages || !pool->used) {
+		kfree(pool->pages);
+		kfree(pool->used);
+		pool->pages = NULL;
+		pool->used = NULL;
+		return -1;
+	}
+
+	hal_rx_pool_resize(pool, GFP_KERNEL, pool->target_pages);
+
+	if (pool->num_pages < num_pages)
+		pr_warn("%s: RX pool has %d of %d pages of order %d\n",
+			hal_name, pool->num_pages, num_pages, pool->order);
+
+	return 0;
+}
+
+
+/* Pool split adaptation
+ *
+ * Each pool always keeps a page per descriptor of its class plus one
+ * refill batch. The rest of the HAL_HOST_BOUNCE_BUF_LEN budget is split
+ * between the pools by the bytes each class received over the last
+ * HAL_RX_POOL_ADAPT_FRAMES frames. The pools then move towards the new
+ * split a few pages per bottom half run.
+ */
+static void hal_rx_pool_adapt(struct hal_priv *priv)
+{
+	struct hal_rx_pool *pool_2k = &priv->rx_pool_2k;
+	struct hal_rx_pool *pool_12k = &priv->rx_pool_12k;
+	unsigned long size_2k, size_12k, min_2k, min_12k, spare;
+	u64 demand_2k, demand_12k;
+	unsigned int extra_12k;
+
+	if (!pool_2k->pages || !pool_12k->pages)
+		return;
+
+	if (priv->rx_adapt_frames_2k + priv->rx_adapt_frames_12k >=
+	    HAL_RX_POOL_ADAPT_FRAMES) {
+		size_2k = PAGE_SIZE << pool_2k->order;
+		size_12k = PAGE_SIZE << pool_12k->order;
+		min_2k = priv->rx_bufs_2k + MAX_RX_BUF_PTR_PER_CMD;
+		min_12k = priv->rx_bufs_12k + MAX_RX_BUF_PTR_PER_CMD;
+
+		if (min_2k * size_2k + min_12k * size_12k <
+		    HAL_HOST_BOUNCE_BUF_LEN)
+			spare = HAL_HOST_BOUNCE_BUF_LEN - min_2k * size_2k -
+				min_12k * size_12k;
+		else
+			spare = 0;
+
+		demand_2k = priv->rx_adapt_bytes_2k;
+		demand_12k = priv->rx_adapt_bytes_12k;
+
+		extra_12k = (demand_2k + demand_12k) ?
+			    div64_u64((u64)spare * demand_12k,
+				      demand_2k + demand_12k) / size_12k : 0;
+
+		pool_12k->target_pages = min_t(unsigned int,
+					       min_12k + extra_12k,
+					       pool_12k->max_pages);
+		pool_2k->target_pages = min_t(unsigned int,
+					      min_2k + (spare - extra_12k *
+							size_12k) / size_2k,
+					      pool_2k->max_pages);
+
+		priv->rx_adapt_frames_2k = 0;
+		priv->rx_adapt_frames_12k = 0;
+		priv->rx_adapt_bytes_2k = 0;
+		priv->rx_adapt_bytes_12k = 0;
+	}
+
+	/* The shrinking pool goes first to stay within the budget */
+	if (pool_12k->num_pages > pool_12k->target_pages) {
+		hal_rx_pool_resize(pool_12k, GFP_ATOMIC,
+				   HAL_RX_POOL_ADAPT_STEP);
+		hal_rx_pool_resize(pool_2k, GFP_ATOMIC,
+				   HAL_RX_POOL_ADAPT_STEP);
+	} else {
+		hal_rx_pool_resize(pool_2k, GFP_ATOMIC,
+				   HAL_RX_POOL_ADAPT_STEP);
+		hal_rx_pool_resize(pool_12k, GFP_ATOMIC,
+				   HAL_RX_POOL_ADAPT_STEP);
+	}
+}
+
+
+static void hal_rx_hist_update(struct hal_priv *priv,
+			       unsigned int data_length,
+			       unsigned int max_data_size)
+{
+	unsigned int bin = fls(data_length >> 8);
+
+	if (bin >= HAL_RX_HIST_BINS)
+		bin = HAL_RX_HIST_BINS - 1;
+
+	priv->rx_len_hist[bin]++;
+	priv->rx_data_bytes += data_length;
+
+	if (max_data_size > MAX_DATA_SIZE_2K) {
+		priv->rx_adapt_frames_12k++;
+		priv->rx_adapt_bytes_12k += data_length;
+	} else {
+		priv->rx_adapt_frames_2k++;
+		priv->rx_adapt_bytes_2k += data_length;
+	}
+}
+
+
+static void hal_rx_pool_deinit(struct hal_rx_pool *pool)
+{
+	unsigned int i;
+
+	/* Pages still held by the stack are freed along with the skb */
+	for (i = 0; i < pool->num_pages; i++)
+		put_page(pool->pages[i]);
+
+	kfree(pool->pages);
+	kfree(pool->used);
+	pool->pages = NULL;
+	pool->used = NULL;
+	pool->num_pages = 0;
+}
+
+
+/* Get up to num skbs from the pool, returns the number got. Pages are
+ * handed out in ring order, so the page at next is the one the stack got
+ * first and the most likely to be back. At most HAL_RX_POOL_PROBE pages
+ * are checked per skb, a page still held is passed over till the next
+ * round.
+ */
+static unsigned int hal_rx_pool_get_bulk(struct hal_rx_pool *pool,
+					 struct sk_buff **skbs,
+					 unsigned int num)
+{
+	struct page *page;
+	struct sk_buff *skb;
+	unsigned int probe, idx = 0, cnt = 0;
+
+	while (cnt < num && pool->num_pages) {
+		for (probe = 0; probe < HAL_RX_POOL_PROBE; probe++) {
+			idx = pool->next;
+			pool->next = (idx + 1) % pool->num_pages;
+
+			/* Only the pool reference left, the stack is done */
+			if (page_count(pool->pages[idx]) == 1)
+				break;
+		}
+
+		if (probe == HAL_RX_POOL_PROBE)
+			break;
+
+		page = pool->pages[idx];
+		skb = build_skb(page_address(page), PAGE_SIZE << pool->order);
+
+		if (!skb)
+			break;
+
+		/* Reference owned by the skb head */
+		get_page(page);
+
+		if (__test_and_set_bit(idx, pool->used))
+			hpriv->rx_pool_recycled++;
+
+		skbs[cnt++] = skb;
+	}
+
+	return cnt;
+}
+
+
+static struct sk_buff *hal_rx_pool_get(struct hal_rx_pool *pool,
+				       unsigned int max_data_size)
+{
+	struct sk_buff *skb;
+
+	if (hal_rx_pool_get_bulk(pool, &skb, 1))
+		return skb;
+
+	return NULL;
+}
+
+
+/* Replacement buffers for all the descriptors of one RX event */
+static void hal_rx_bulk_alloc(struct hal_priv *priv, struct event_hal *evnt)
+{
+	unsigned int i, num_12k = 0, num_2k = 0;
+
+	for (i = 0; i < evnt->rx_pkt_cnt; i++) {
+		if (evnt->rx_pkt_desc[i] < priv->rx_bufs_12k)
+			num_12k++;
+		else
+			num_2k++;
+	}
+
+	priv->rx_bulk_12k.next = 0;
+	priv->rx_bulk_12k.cnt = hal_rx_pool_get_bulk(&priv->rx_pool_12k,
+						     priv->rx_bulk_12k.skb,
+						     num_12k);
+	priv->rx_bulk_2k.next = 0;
+	priv->rx_bulk_2k.cnt = hal_rx_pool_get_bulk(&priv->rx_pool_2k,
+						    priv->rx_bulk_2k.skb,
+						    num_2k);
+}
+
+
+static struct sk_buff *hal_rx_bulk_get(struct hal_priv *priv,
+				       unsigned int max_data_size)
+{
+	struct hal_rx_bulk *bulk;
+
+	if (max_data_size > MAX_DATA_SIZE_2K)
+		bulk = &priv->rx_bulk_12k;
+	else
+		bulk = &priv->rx_bulk_2k;
+
+	if (bulk->next < bulk->cnt)
+		return bulk->skb[bulk->next++];
+
+	priv->rx_pool_miss++;
+
+	return alloc_skb(max_data_size, GFP_ATOMIC);
+}
+
+
+/* Buffers not used (dropped descriptors) go back to the pool */
+static void hal_rx_bulk_release(struct hal_priv *priv)
+{
+	struct hal_rx_bulk *bulk = &priv->rx_bulk_12k;
+
+	while (bulk->next < bulk->cnt)
+		dev_kfree_skb_any(bulk->skb[bulk->next++]);
+
+	bulk = &priv->rx_bulk_2k;
+
+	while (bulk->next < bulk->cnt)
+		dev_kfree_skb_any(bulk->skb[bulk->next++]);
+}
+
+
+static struct sk_buff *hal_rx_alloc_skb(unsigned int max_data_size)
+{
+	struct hal_rx_pool *pool;
+	struct sk_buff *skb;
+
+	if (max_data_size > MAX_DATA_SIZE_2K)
+		pool = &hpriv->rx_pool_12k;
+	else
+		pool = &hpriv->rx_pool_2k;
+
+	skb = hal_rx_pool_get(pool, max_data_size);
+
+	if (skb)
+		return skb;
+
+	hpriv->rx_pool_miss++;
+
+	return alloc_skb(max_data_size, GFP_ATOMIC);
+}
+
+
 static void hal_deinit_bufs(void)
 {
 	int i = 0, j = 0;
@@ -1737,6 +3426,8 @@ static void hal_deinit_bufs(void)
 
 	tasklet_disable(&hpriv->rx_tasklet);
 	tasklet_disable(&hpriv->recv_tasklet);
+	napi_disable(&hpriv->napi);
+	mutex_lock(&hpriv->rx_thread_lock);
 
 	if (hpriv->rx_buf_info) {
 		for (i = 0; i < hpriv->rx_bufs_2k + hpriv->rx_bufs_12k; i++) {
@@ -1762,6 +3453,13 @@ static void hal_deinit_bufs(void)
 		hpriv->rx_buf_info = NULL;
 	}
 
+	hal_rx_pool_deinit(&hpriv->rx_pool_2k);
+	hal_rx_pool_deinit(&hpriv->rx_pool_12k);
+
+	kfree(hpriv->refill_cmds);
+	hpriv->refill_cmds = NULL;
+	hpriv->refill_cmds_used = 0;
+
 	if (hpriv->tx_buf_info) {
 		for (i = 0; i < hpriv->tx_bufs; i++) {
 			for (j = 0; i < NUM_FRAMES_IN_TX_DESC; i++) {
@@ -1786,6 +3484,12 @@ static void hal_deinit_bufs(void)
 	hpriv->hal_disabled = 1;
 	tasklet_enable(&hpriv->rx_tasklet);
 	tasklet_enable(&hpriv->recv_tasklet);
+	mutex_unlock(&hpriv->rx_thread_lock);
+	napi_enable(&hpriv->napi);
+
+	/* An interrupt taken while NAPI was disabled left the line masked */
+	if (hpriv->irq_masked)
+		hal_rx_schedule(hpriv);
 }
 
 
@@ -1806,6 +3510,8 @@ static int hal_init_bufs(unsigned int tx_bufs,
 	hpriv->tx_bufs = tx_bufs;
 	hpriv->rx_bufs_2k = rx_bufs_2k;
 	hpriv->rx_bufs_12k = rx_bufs_12k;
+	hpriv->rx_bufs_fw = rx_bufs_2k + rx_bufs_12k;
+	hpriv->rx_bufs_12k_fw = rx_bufs_12k;
 	hpriv->max_data_size = tx_max_data_size;
 	hpriv->tx_base_addr_uccp_host_ram = hpriv->base_addr_uccp_host_ram;
 	hpriv->rx_base_addr_uccp_host_ram = hpriv->base_addr_uccp_host_ram +
@@ -1821,6 +3527,28 @@ static int hal_init_bufs(unsigned int tx_bufs,
 		goto err;
 	}
 
+	/* Twice the descriptors, so frames held up in the stack do not
+	 * starve the refill
+	 */
+	if (hal_rx_pool_init(&hpriv->rx_pool_2k, 2 * rx_bufs_2k,
+			     MAX_DATA_SIZE_2K) ||
+	    hal_rx_pool_init(&hpriv->rx_pool_12k, 2 * rx_bufs_12k,
+			     MAX_DATA_SIZE_12K)) {
+		pr_err("%s out of memory\n", hal_name);
+		goto err;
+	}
+
+	hpriv->refill_cmds_max = DIV_ROUND_UP(rx_bufs_2k + rx_bufs_12k,
+					      MAX_RX_BUF_PTR_PER_CMD);
+	hpriv->refill_cmds_used = 0;
+	hpriv->refill_cmds = kcalloc(hpriv->refill_cmds_max,
+				     sizeof(struct cmd_hal), GFP_KERNEL);
+
+	if (!hpriv->refill_cmds) {
+		pr_err("%s out of memory\n", hal_name);
+		goto err;
+	}
+
 	hpriv->rx_buf_info = kzalloc(((rx_bufs_2k + rx_bufs_12k) *
 				      sizeof(struct buf_info)), GFP_KERNEL);
 
@@ -1897,28 +3625,24 @@ err:
 }
 
 
-int hal_map_tx_buf(int pkt_desc, int frame_id, unsigned char *data, int len)
+/* Map one TX entry, data outside of the RPU window is bounced through the
+ * private TX area
+ */
+static int hal_tx_slot_map(unsigned int index, unsigned char *data, int len)
 {
-	unsigned int index = (pkt_desc * NUM_FRAMES_IN_TX_DESC) + frame_id;
 	void __iomem  *tx_address = NULL;
 	int i, j;
 	dma_addr_t dma_buf = 0;
 	dma_addr_t curr_buf = 0;
 
-	/* For QoS Null frames we dont try to map the frame since the data len
-	 * will be 0 and there is nothing for the FW to process
-	 */
-	if (len == 0)
-		return 0;
-
 	/* Sanity check */
 	dma_buf = ((struct buf_info)(hpriv->tx_buf_info[index])).dma_buf;
 
 	if (dma_buf) {
 		pr_err("%s: Already mapped pkt descriptor: %d and frame: %d dma_buf: 0x%x dma_buf: 0x%x index: %d\n",
 		       __func__,
-		       pkt_desc,
-		       frame_id,
+		       index / NUM_FRAMES_IN_TX_DESC,
+		       index % NUM_FRAMES_IN_TX_DESC,
 		       (unsigned int)hpriv->tx_buf_info[index].dma_buf,
 		       (unsigned int)dma_buf,
 		       index);
@@ -1951,6 +3675,7 @@ int hal_map_tx_buf(int pkt_desc, int frame_id, unsigned char *data, int len)
 
 		memcpy(tx_address, data, len);
 		alloc_skb_priv_tx_region++;
+		hpriv->tx_bounce++;
 	} else {
 		tx_address = data;
 		alloc_skb_dma_region++;
@@ -1975,32 +3700,263 @@ int hal_map_tx_buf(int pkt_desc, int frame_id, unsigned char *data, int len)
 }
 
 
-int hal_unmap_tx_buf(int pkt_desc, int frame_id)
+/* Reserve the next TX entry of the descriptor for a frame, frames are
+ * mapped in order starting from frame 0. Returns the index of the entry
+ * or -1.
+ */
+static int hal_tx_slot_alloc(int pkt_desc, int frame_id)
+{
+	unsigned int slot = frame_id ? hpriv->tx_slots_used[pkt_desc] : 0;
+	unsigned int nslots = 1;
+
+	if (slot + nslots > NUM_FRAMES_IN_TX_DESC) {
+		pr_err("%s: No TX entries left in descriptor %d for frame %d\n",
+		       hal_name, pkt_desc, frame_id);
+		return -1;
+	}
+
+	hpriv->tx_frame_slot[pkt_desc][frame_id] = slot;
+	hpriv->tx_frame_nslots[pkt_desc][frame_id] = nslots;
+	hpriv->tx_slots_used[pkt_desc] = slot + nslots;
+
+	return (pkt_desc * NUM_FRAMES_IN_TX_DESC) + slot;
+}
+
+
+int hal_map_tx_buf(int pkt_desc, int frame_id, unsigned char *data, int len)
 {
-	unsigned int index = (pkt_desc * NUM_FRAMES_IN_TX_DESC) + frame_id;
+	int index = hal_tx_slot_alloc(pkt_desc, frame_id);
 
-	/* For QoS Null frames we did not map the frame (since the data len
-	 * will be 0 and there is nothing for the FW to process), hence no need
-	 * to try and unmap
+	if (index < 0)
+		return -1;
+
+	/* For QoS Null frames we dont try to map the frame since the data len
+	 * will be 0 and there is nothing for the FW to process
 	 */
-	if (!hpriv->tx_buf_info[index].dma_buf_len)
+	if (len == 0)
 		return 0;
 
-	/* Sanity check */
-	if (!hpriv->tx_buf_info[index].dma_buf) {
-		pr_err("%s called for unmapped pkt desc: %d , frame: %d\n",
-		       __func__, pkt_desc, frame_id);
+	if (hal_tx_slot_map(index, data, len)) {
+		/* Give the slot back */
+		hpriv->tx_slots_used[pkt_desc] = hpriv->tx_frame_slot[pkt_desc]
+								     [frame_id];
+		hpriv->tx_frame_nslots[pkt_desc][frame_id] = 0;
 		return -1;
 	}
 
-	dma_unmap_single(NULL,
-			 hpriv->tx_buf_info[index].dma_buf,
-			 hpriv->tx_buf_info[index].dma_buf_len,
-			 DMA_TO_DEVICE);
+	return 0;
+}
+
+
+/* Batched descriptor mapping
+ *
+ * All entries of a descriptor (frames or their bounce buffers) are
+ * collected in the descriptor scatterlist and mapped with a single
+ * dma_map_sg, and unmapped the same way. If the platform merges elements
+ * the entries are mapped one by one instead.
+ */
+static int hal_map_tx_desc_sg(struct hal_priv *priv, int pkt_desc,
+			      struct sk_buff_head *skb_list)
+{
+	struct scatterlist *sgl = priv->tx_sgl[pkt_desc];
+	unsigned char *sgl_slot = priv->tx_sgl_slot[pkt_desc];
+	unsigned int base = pkt_desc * NUM_FRAMES_IN_TX_DESC;
+	struct buf_info *tx_buf_info;
+	struct scatterlist *sg;
+	struct sk_buff *skb;
+	void *data;
+	int pkt = 0, nents = 0, mapped;
+	int index, i;
+
+	sg_init_table(sgl, NUM_FRAMES_IN_TX_DESC);
+
+	skb_queue_walk(skb_list, skb) {
+		index = hal_tx_slot_alloc(pkt_desc, pkt);
+
+		if (index < 0)
+			goto reset;
+
+		pkt++;
+
+		/* QoS Null frames are not mapped */
+		if (!skb->len)
+			continue;
+
+		data = skb->data;
+
+		if (!is_mem_dma(data, skb->len)) {
+			/* Copy SKB to the UCCP Private Area */
+			data = priv->tx_base_addr_uccp_host_ram +
+			       (index * priv->max_data_size);
+			memcpy(data, skb->data, skb->len);
+			alloc_skb_priv_tx_region++;
+			priv->tx_bounce++;
+		} else {
+			alloc_skb_dma_region++;
+		}
+
+		sg_set_buf(&sgl[nents], data, skb->len);
+		sgl_slot[nents++] = index - base;
+	}
+
+	if (!nents)
+		return 0;
+
+	sg_mark_end(&sgl[nents - 1]);
+
+	mapped = dma_map_sg(NULL, sgl, nents, DMA_TO_DEVICE);
+
+	if (!mapped) {
+		pr_err("%s Unable to map DMA on TX\n", hal_name);
+		goto reset;
+	}
+
+	if (mapped == nents) {
+		for_each_sg(sgl, sg, nents, i) {
+			tx_buf_info = &priv->tx_buf_info[base + sgl_slot[i]];
+			tx_buf_info->dma_buf = sg_dma_address(sg);
+			tx_buf_info->dma_buf_len = sg_dma_len(sg);
+		}
+
+		priv->tx_sgl_nents[pkt_desc] = nents;
+
+		return 0;
+	}
+
+	/* Elements were merged, the FW needs one address per entry */
+	dma_unmap_sg(NULL, sgl, nents, DMA_TO_DEVICE);
 
-	memset(&hpriv->tx_buf_info[index], 0, sizeof(struct buf_info));
+	for_each_sg(sgl, sg, nents, i) {
+		tx_buf_info = &priv->tx_buf_info[base + sgl_slot[i]];
+		tx_buf_info->dma_buf = dma_map_page(NULL, sg_page(sg),
+						    sg->offset, sg->length,
+						    DMA_TO_DEVICE);
+
+		if (unlikely(dma_mapping_error(NULL, tx_buf_info->dma_buf))) {
+			pr_err("%s Unable to map DMA on TX\n", hal_name);
+			tx_buf_info->dma_buf = 0;
+			goto unmap;
+		}
+
+		tx_buf_info->dma_buf_len = sg->length;
+		tx_buf_info->dma_buf_page = 1;
+	}
 
 	return 0;
+
+unmap:
+	/* Unmap the entries mapped before the failing one */
+	while (i--) {
+		tx_buf_info = &priv->tx_buf_info[base + sgl_slot[i]];
+		dma_unmap_page(NULL, tx_buf_info->dma_buf,
+			       tx_buf_info->dma_buf_len, DMA_TO_DEVICE);
+		memset(tx_buf_info, 0, sizeof(struct buf_info));
+	}
+
+reset:
+	/* Nothing of the descriptor is mapped, give all its slots back */
+	priv->tx_slots_used[pkt_desc] = 0;
+	memset(priv->tx_frame_nslots[pkt_desc], 0,
+	       sizeof(priv->tx_frame_nslots[pkt_desc]));
+
+	return -1;
+}
+
+
+/* Map all frames of a descriptor, in one go unless tx_map_batch is off */
+static int hal_map_tx_desc(int pkt_desc, void *list)
+{
+	struct sk_buff_head *skb_list = (struct sk_buff_head *)list;
+	struct sk_buff *skb;
+	u64 start = ktime_get_ns();
+	int pkt = 0, ret = 0;
+
+	if (tx_map_batch) {
+		ret = hal_map_tx_desc_sg(hpriv, pkt_desc, skb_list);
+	} else {
+		skb_queue_walk(skb_list, skb) {
+			ret = hal_map_tx_buf(pkt_desc, pkt++, skb->data,
+					     skb->len);
+
+			if (ret)
+				break;
+		}
+	}
+
+	hal_hist_add(HAL_HIST_TX_MAP, ktime_get_ns() - start);
+
+	return ret;
+}
+
+
+int hal_unmap_tx_buf(int pkt_desc, int frame_id)
+{
+	unsigned int slot = hpriv->tx_frame_slot[pkt_desc][frame_id];
+	unsigned int nslots = hpriv->tx_frame_nslots[pkt_desc][frame_id];
+	unsigned int index = (pkt_desc * NUM_FRAMES_IN_TX_DESC) + slot;
+	struct buf_info *tx_buf_info;
+	int ret = 0;
+
+	hpriv->tx_frame_nslots[pkt_desc][frame_id] = 0;
+
+	for (; nslots; nslots--, index++) {
+		tx_buf_info = &hpriv->tx_buf_info[index];
+
+		/* For QoS Null frames we did not map the frame (since the data
+		 * len will be 0 and there is nothing for the FW to process),
+		 * hence no need to try and unmap
+		 */
+		if (!tx_buf_info->dma_buf_len)
+			continue;
+
+		/* Sanity check */
+		if (!tx_buf_info->dma_buf) {
+			pr_err("%s called for unmapped pkt desc: %d , frame: %d\n",
+			       __func__, pkt_desc, frame_id);
+			ret = -1;
+			continue;
+		}
+
+		if (tx_buf_info->dma_buf_page)
+			dma_unmap_page(NULL,
+				       tx_buf_info->dma_buf,
+				       tx_buf_info->dma_buf_len,
+				       DMA_TO_DEVICE);
+		else
+			dma_unmap_single(NULL,
+					 tx_buf_info->dma_buf,
+					 tx_buf_info->dma_buf_len,
+					 DMA_TO_DEVICE);
+
+		memset(tx_buf_info, 0, sizeof(struct buf_info));
+	}
+
+	return ret;
+}
+
+
+static void hal_unmap_tx_desc(int pkt_desc, int num_frames)
+{
+	unsigned int base = pkt_desc * NUM_FRAMES_IN_TX_DESC;
+	u64 start = ktime_get_ns();
+	int pkt;
+
+	if (hpriv->tx_sgl_nents[pkt_desc]) {
+		dma_unmap_sg(NULL, hpriv->tx_sgl[pkt_desc],
+			     hpriv->tx_sgl_nents[pkt_desc], DMA_TO_DEVICE);
+		hpriv->tx_sgl_nents[pkt_desc] = 0;
+
+		memset(&hpriv->tx_buf_info[base], 0,
+		       hpriv->tx_slots_used[pkt_desc] *
+		       sizeof(struct buf_info));
+		memset(hpriv->tx_frame_nslots[pkt_desc], 0,
+		       sizeof(hpriv->tx_frame_nslots[pkt_desc]));
+	} else {
+		for (pkt = 0; pkt < num_frames; pkt++)
+			hal_unmap_tx_buf(pkt_desc, pkt);
+	}
+
+	hal_hist_add(HAL_HIST_TX_UNMAP, ktime_get_ns() - start);
 }
 
 
@@ -2051,7 +4007,7 @@ static int init_rx_buf(int pkt_desc,
 
 	if (new_skb == NULL) {
 
-		rx_skb = alloc_skb(max_data_size, GFP_ATOMIC);
+		rx_skb = hal_rx_alloc_skb(max_data_size);
 
 		if (!rx_skb) {
 			alloc_skb_failures++;
@@ -2131,6 +4087,11 @@ void hal_disable_irq_wake(void)
 	disable_irq_wake(hpriv->irq);
 }
 
+struct napi_struct *hal_get_rx_napi(void)
+{
+	return hpriv->napi_ctx;
+}
+
 
 struct hal_ops_tag hal_ops = {
 	.init = hal_init,
@@ -2138,6 +4099,12 @@ struct hal_ops_tag hal_ops = {
 	.start = hal_start,
 	.stop = hal_stop,
 	.register_callback = hal_register_callback,
+	.register_rx_filter = hal_register_rx_filter,
+	.request_rings		= hal_request_rings,
+	.get_cmd_buf		= hal_get_cmd_buf,
+	.free_cmd_buf		= hal_free_cmd_buf,
+	.map_tx_desc		= hal_map_tx_desc,
+	.unmap_tx_desc		= hal_unmap_tx_desc,
 	.send = hal_send,
 	.init_bufs = hal_init_bufs,
 	.deinit_bufs = hal_deinit_bufs,
@@ -2155,6 +4122,7 @@ struct hal_ops_tag hal_ops = {
 	.get_dump_len		= hal_get_dump_len,
 	.update_axd_timestamps	= hal_update_axd_timestamps,
 	.get_axd_buf_phy_addr	= hal_get_axd_buf_phy_addr,
+	.get_rx_napi		= hal_get_rx_napi,
 };
 
 #ifdef CONFIG_PM
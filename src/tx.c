@@ -89,28 +89,35 @@ static void update_aux_adc_voltage(struct mac80211_dev *dev,
 	dev->params->pdout_voltage[index++] = pdout;
 }
 
+/* Pending queue of the TID of a frame within its AC, non QoS frames use
+ * the first one
+ */
+static int tx_tid_slot(struct sk_buff *skb)
+{
+	struct ieee80211_hdr *mac_hdr = (struct ieee80211_hdr *)skb->data;
+	u8 tid;
+
+	if (!ieee80211_is_data_qos(mac_hdr->frame_control))
+		return 0;
+
+	tid = *ieee80211_get_qos_ctl(mac_hdr) & IEEE80211_QOS_CTL_TID_MASK;
+
+	/* BE 0/3, BK 1/2, VI 4/5, VO 6/7 */
+	return tid & 1;
+}
+
+
 static int check_80211_aggregation(struct mac80211_dev *dev,
 				struct sk_buff *skb,
-			       int ac,
-#ifdef MULTI_CHAN_SUPPORT
-			       int off_chanctx_idx,
-#endif
-			       int peer_id)
+				struct sk_buff_head *pend_pkt_q)
 {
 
 	struct ieee80211_tx_info *tx_info = IEEE80211_SKB_CB(skb);
 	struct ieee80211_hdr *mac_hdr = NULL, *mac_hdr_first = NULL;
 	struct sk_buff *skb_first;
-	struct sk_buff_head *pend_pkt_q = NULL;
-	struct tx_config *tx = &dev->tx;
 	bool ampdu = false, is_qos = false, addr = true;
 
 	mac_hdr = (struct ieee80211_hdr *)skb->data;
-#ifdef MULTI_CHAN_SUPPORT
-	pend_pkt_q = &tx->pending_pkt[off_chanctx_idx][peer_id][ac];
-#else
-	pend_pkt_q = &tx->pending_pkt[peer_id][ac];
-#endif
 	skb_first = skb_peek(pend_pkt_q);
 	if (skb_first)
 		mac_hdr_first = (struct ieee80211_hdr *)skb_first->data;
@@ -157,6 +164,159 @@ static int check_80211_aggregation(struct mac80211_dev *dev,
 }
 
 
+/* Data rate in kbps of HT/VHT MCS 0-9, 1 stream, 20MHz, long GI */
+static const unsigned int tx_mcs_kbps[] = {
+	6500, 13000, 19500, 26000, 39000, 52000, 58500, 65000, 78000, 86700
+};
+
+/* 1, 2, 5.5 and 11 Mbps in units of 500 kbps, sent with the DSSS long
+ * preamble. 6 and 9 Mbps OFDM fall in the same range but are not DSSS.
+ */
+static bool tx_rate_is_dsss(unsigned char rate)
+{
+	switch (rate) {
+	case 2:
+	case 4:
+	case 11:
+	case 22:
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+/* Data rate in kbps and preamble in us of a rate coded as in TX done, the
+ * bandwidth, GI and VHT stream count come from txrate.
+ */
+static unsigned int tx_rate_kbps(unsigned char rate,
+				 struct ieee80211_tx_rate *txrate,
+				 unsigned int *preamble_us)
+{
+	unsigned int rate_kbps, mcs, nss;
+
+	if (rate & MARK_RATE_AS_MCS_INDEX) {
+		if (txrate->flags & IEEE80211_TX_RC_VHT_MCS) {
+			mcs = rate & 0x0F;
+			nss = ieee80211_rate_get_vht_nss(txrate);
+		} else {
+			mcs = (rate & 0x7F) % 8;
+			nss = ((rate & 0x7F) / 8) + 1;
+		}
+
+		rate_kbps = tx_mcs_kbps[min_t(unsigned int, mcs, 9)] * nss;
+
+		if (txrate->flags & IEEE80211_TX_RC_80_MHZ_WIDTH)
+			rate_kbps = rate_kbps * 234 / 52;
+		else if (txrate->flags & IEEE80211_TX_RC_40_MHZ_WIDTH)
+			rate_kbps = rate_kbps * 108 / 52;
+
+		if (txrate->flags & IEEE80211_TX_RC_SHORT_GI)
+			rate_kbps = rate_kbps * 10 / 9;
+
+		*preamble_us = 40;
+	} else {
+		/* Units of 500 kbps */
+		rate_kbps = rate * 500;
+		*preamble_us = tx_rate_is_dsss(rate) ? 192 : 20;
+	}
+
+	if (!rate_kbps)
+		rate_kbps = 1000;
+
+	return rate_kbps;
+}
+
+
+/* Airtime in us of a descriptor from the TX done rate and retries of each
+ * frame: the data time of each frame times its attempts, plus a preamble
+ * for each attempt of the PPDU. Frames the FW did not send are not
+ * counted, the bytes of the frames acked are returned in bytes.
+ */
+static unsigned int tx_airtime(struct umac_event_tx_done *tx_done,
+			       struct sk_buff_head *list,
+			       unsigned int hdr_len,
+			       unsigned int *bytes)
+{
+	struct ieee80211_tx_rate *txrate;
+	struct sk_buff *skb;
+	unsigned int rate_kbps, preamble_us = 0;
+	unsigned int airtime = 0, pkt = 0;
+
+	*bytes = 0;
+	skb = skb_peek(list);
+
+	if (!skb)
+		return 0;
+
+	txrate = &IEEE80211_SKB_CB(skb)->control.rates[0];
+
+	skb_queue_walk(list, skb) {
+		if (tx_done->frm_status[pkt] == TX_DONE_STAT_SUCCESS)
+			*bytes += skb->len + hdr_len;
+
+		if (tx_done->frm_status[pkt] != TX_DONE_STAT_SUCCESS &&
+		    tx_done->frm_status[pkt] != TX_DONE_STAT_ERR_RETRY_LIM) {
+			pkt++;
+			continue;
+		}
+
+		rate_kbps = tx_rate_kbps(tx_done->rate[pkt], txrate,
+					 &preamble_us);
+		airtime += ((skb->len + hdr_len) * 8 * 1000 / rate_kbps) *
+			   (tx_done->retries_num[pkt] + 1);
+		pkt++;
+	}
+
+	return airtime + preamble_us * (tx_done->retries_num[0] + 1);
+}
+
+
+/* Airtime in us a descriptor is expected to take at the first rate picked
+ * by rate control, without retries. Charged when the descriptor is built,
+ * tx_airtime corrects it at TX done.
+ */
+static unsigned int tx_airtime_estimate(struct mac80211_dev *dev,
+					struct sk_buff_head *txq)
+{
+	struct ieee80211_tx_info *tx_info;
+	struct ieee80211_tx_rate *txrate;
+	struct ieee80211_rate *legacy;
+	struct sk_buff *skb;
+	unsigned int rate_kbps, preamble_us = 0;
+	unsigned int airtime = 0;
+	unsigned char rate = 0;
+
+	skb = skb_peek(txq);
+
+	if (!skb)
+		return 0;
+
+	tx_info = IEEE80211_SKB_CB(skb);
+	txrate = &tx_info->control.rates[0];
+
+	if (txrate->flags & IEEE80211_TX_RC_VHT_MCS) {
+		rate = MARK_RATE_AS_MCS_INDEX |
+		       ieee80211_rate_get_vht_mcs(txrate);
+	} else if (txrate->flags & IEEE80211_TX_RC_MCS) {
+		rate = MARK_RATE_AS_MCS_INDEX | txrate->idx;
+	} else if (txrate->idx >= 0) {
+		/* Bitrates are in units of 100 kbps */
+		legacy = ieee80211_get_tx_rate(dev->hw, tx_info);
+
+		if (legacy)
+			rate = legacy->bitrate / 5;
+	}
+
+	rate_kbps = tx_rate_kbps(rate, txrate, &preamble_us);
+
+	skb_queue_walk(txq, skb)
+		airtime += skb->len * 8 * 1000 / rate_kbps;
+
+	return airtime + preamble_us;
+}
+
+
 static void tx_status(struct sk_buff *skb,
 		      struct umac_event_tx_done *tx_done,
 		      unsigned int frame_idx,
@@ -311,46 +471,51 @@ prog_umac_fail:
 }
 
 
+/* Claim the lowest free token of mask in the pool bitmap, -1 if none.
+ * Called with tx->lock held, or on a bitmap the caller owns.
+ */
+static inline int tx_token_claim(unsigned long *bmp, unsigned long mask)
+{
+	unsigned long free = ~*bmp & mask;
+	int bit = find_first_bit(&free, NUM_TX_DESCS);
+
+	if (bit >= NUM_TX_DESCS)
+		return -1;
+
+	__set_bit(bit, bmp);
+
+	return bit;
+}
+
+
+/* Token policy: an AC first takes one of its reserved tokens. Once those
+ * are all in use, non beacon ACs borrow the lowest free spare token. The
+ * beacon queue never borrows.
+ */
+static int tx_token_get(struct tx_config *tx, unsigned long *bmp, int queue)
+{
+	int token_id = tx_token_claim(bmp, tx->ac_token_mask[queue]);
+
+	if (token_id < 0 && queue != WLAN_AC_BCN)
+		token_id = tx_token_claim(bmp, tx->spare_token_mask);
+
+	return token_id;
+}
+
+
 static int get_token(struct mac80211_dev *dev,
 #ifdef MULTI_CHAN_SUPPORT
 		     int curr_chanctx_idx,
 #endif
 		     int queue)
 {
-	int cnt = 0;
-	int curr_bit = 0;
-	int pool_id = 0;
-	int token_id = NUM_TX_DESCS;
 	struct tx_config *tx = &dev->tx;
+	int token_id = tx_token_get(tx, &tx->buf_pool_bmp[0], queue);
 
-	/* First search for a reserved token */
-	for (cnt = 0; cnt < NUM_TX_DESCS_PER_AC; cnt++) {
-		curr_bit = ((queue + (NUM_ACS * cnt)) % TX_DESC_BUCKET_BOUND);
-		pool_id = ((queue + (NUM_ACS * cnt)) / TX_DESC_BUCKET_BOUND);
-
-		if (!test_and_set_bit(curr_bit, &tx->buf_pool_bmp[pool_id])) {
-			token_id = queue + (NUM_ACS * cnt);
-			tx->outstanding_tokens[queue]++;
-			break;
-		}
-	}
+	if (token_id < 0)
+		return NUM_TX_DESCS;
 
-	/* If reserved token is not found search for a spare token
-	 * (only for non beacon queues)
-	 */
-	if ((cnt == NUM_TX_DESCS_PER_AC) && (queue != WLAN_AC_BCN)) {
-		for (token_id = NUM_TX_DESCS_PER_AC * NUM_ACS;
-		     token_id < NUM_TX_DESCS;
-		     token_id++) {
-			curr_bit = (token_id % TX_DESC_BUCKET_BOUND);
-			pool_id = (token_id / TX_DESC_BUCKET_BOUND);
-			if (!test_and_set_bit(curr_bit,
-					      &tx->buf_pool_bmp[pool_id])) {
-				tx->outstanding_tokens[queue]++;
-				break;
-			}
-		}
-	}
+	tx->outstanding_tokens[queue]++;
 
 	return token_id;
 }
@@ -360,20 +525,16 @@ void free_token(struct mac80211_dev *dev,
 		int queue)
 {
 	struct tx_config *tx = &dev->tx;
-	int bit = -1;
-	int pool_id = -1;
 	int test = 0;
 	unsigned int old_token = tx->outstanding_tokens[queue];
 
-	bit = (token_id % TX_DESC_BUCKET_BOUND);
-	pool_id = (token_id / TX_DESC_BUCKET_BOUND);
-
-	__clear_bit(bit, &tx->buf_pool_bmp[pool_id]);
+	clear_bit(token_id, &tx->buf_pool_bmp[0]);
 
 	tx->outstanding_tokens[queue]--;
 
 	test = tx->outstanding_tokens[queue];
-	if (WARN_ON_ONCE(test < 0 || test > 4)) {
+	if (WARN_ON_ONCE(test < 0 ||
+			 test > NUM_TX_DESCS_PER_AC + NUM_SPARE_TX_DESCS)) {
 		UCCP_DEBUG_TX("%s: invalid outstanding_tokens: %d, old:%d\n",
 			      __func__,
 			      test,
@@ -382,16 +543,95 @@ void free_token(struct mac80211_dev *dev,
 }
 
 
-struct curr_peer_info get_curr_peer_opp(struct mac80211_dev *dev,
+/* Token allocator microbenchmark: drain and refill all descriptors on a
+ * scratch bitmap, every AC in turn, using the live token masks.
+ */
+void uccp420wlan_tx_token_bench(struct mac80211_dev *dev,
+				unsigned int iterations)
+{
+	struct tx_config *tx = &dev->tx;
+	unsigned long bmp = 0;
+	unsigned long ops = 0;
+	unsigned int i;
+	int ac;
+	u64 start, get_ns = 0, put_ns = 0;
+
+	for (i = 0; i < iterations; i++) {
+		start = ktime_get_ns();
+
+		for (ac = 0; ac < NUM_ACS; ac++) {
+			while (tx_token_get(tx, &bmp, ac) >= 0)
+				ops++;
+		}
+
+		get_ns += ktime_get_ns() - start;
+		start = ktime_get_ns();
+
+		while (bmp)
+			clear_bit(__ffs(bmp), &bmp);
+
+		put_ns += ktime_get_ns() - start;
+
+		/* Run from a proc write, do not hog the CPU */
+		if ((i & 1023) == 1023)
+			cond_resched();
+	}
+
+	pr_info("%s-UMACTX: token bench: %d descs, %lu tokens, get %llu ns/op, put %llu ns/op\n",
+		dev->name, NUM_TX_DESCS, ops,
+		ops ? div64_u64(get_ns, ops) : 0,
+		ops ? div64_u64(put_ns, ops) : 0);
+}
+
+
+/* TID queue of a peer to fill the next descriptor from: the first one
+ * after the last used that holds a full aggregate, else the longest.
+ */
+static struct sk_buff_head *tx_pick_tid(struct mac80211_dev *dev,
+					struct sk_buff_head *tid_q,
+					int ac,
+					unsigned int peer_id,
+					int *tid)
+{
+	struct tx_config *tx = &dev->tx;
+	unsigned int max_tx_cmds = dev->params->max_tx_cmds;
+	unsigned int len, best_len = 0;
+	int i, slot, best = tx->curr_tid[peer_id][ac];
+
+	for (i = 1; i <= TX_TIDS_PER_AC; i++) {
+		slot = (tx->curr_tid[peer_id][ac] + i) % TX_TIDS_PER_AC;
+		len = skb_queue_len(&tid_q[slot]);
+
+		if (len >= max_tx_cmds) {
+			best = slot;
+			break;
+		}
+
+		if (len > best_len) {
+			best = slot;
+			best_len = len;
+		}
+	}
+
+	*tid = best;
+
+	return &tid_q[best];
+}
+
+
+/* Pending queue of a peer (or vif, for ids from MAX_PEERS) to serve on
+ * the current channel context, NULL if the peer can not be served there.
+ */
+static struct sk_buff_head *tx_peer_pend_q(struct mac80211_dev *dev,
 #ifdef MULTI_CHAN_SUPPORT
-					int curr_chanctx_idx,
+					   int curr_chanctx_idx,
 #endif
-					int ac)
+					   int ac,
+					   unsigned int peer_id,
+					   unsigned int *op_chan,
+					   int *tid)
 {
-	unsigned int curr_peer_opp = 0;
-	unsigned int curr_vif_op_chan = UMAC_VIF_CHANCTX_TYPE_OPER;
-	unsigned int i = 0;
-	struct tx_config *tx = NULL;
+	struct tx_config *tx = &dev->tx;
 #ifdef MULTI_CHAN_SUPPORT
 	struct ieee80211_sta *sta = NULL;
 	struct ieee80211_vif *vif = NULL;
@@ -399,151 +639,255 @@ struct curr_peer_info get_curr_peer_opp(struct mac80211_dev *dev,
 	struct umac_vif *uvif = NULL;
 	int vif_index = -1;
 #endif
-	unsigned int init_peer_opp = 0;
-	struct curr_peer_info peer_info;
-	unsigned int pend_q_len;
-	struct sk_buff_head *pend_q = NULL;
 
-	tx = &dev->tx;
+	*op_chan = UMAC_VIF_CHANCTX_TYPE_OPER;
 
 #ifdef MULTI_CHAN_SUPPORT
-	init_peer_opp = tx->curr_peer_opp[curr_chanctx_idx][ac];
-#else
-	init_peer_opp = tx->curr_peer_opp[ac];
-#endif
-	/*TODO: Optimize this loop for BCN_Q
+	rcu_read_lock();
+
+	/* RoC Frame do not have a "sta" entry.
+	 * so we need not handle RoC stuff here
 	 */
-	for (i = 0; i < MAX_PEND_Q_PER_AC; i++) {
-		curr_peer_opp = (init_peer_opp + i) % MAX_PEND_Q_PER_AC;
+	if (peer_id < MAX_PEERS) {
+		sta = rcu_dereference(dev->peers[peer_id]);
 
-#ifdef MULTI_CHAN_SUPPORT
-		rcu_read_lock();
+		if (!sta) {
+			rcu_read_unlock();
+			return NULL;
+		}
 
-		/* RoC Frame do not have a "sta" entry.
-		 * so we need not handle RoC stuff here
-		 */
-		if (curr_peer_opp < MAX_PEERS) {
-			sta = rcu_dereference(dev->peers[curr_peer_opp]);
+		usta = (struct umac_sta *)(sta->drv_priv);
 
-			if (!sta) {
-				rcu_read_unlock();
-				continue;
-			}
+		vif = rcu_dereference(dev->vifs[usta->vif_index]);
 
-			usta = (struct umac_sta *)(sta->drv_priv);
+		if (!vif) {
+			rcu_read_unlock();
+			return NULL;
+		}
 
-			vif = rcu_dereference(dev->vifs[usta->vif_index]);
-
-			if (!vif) {
-				rcu_read_unlock();
-				continue;
-			}
 
+		uvif = (struct umac_vif *)(vif->drv_priv);
 
-			uvif = (struct umac_vif *)(vif->drv_priv);
+		if (!uvif->chanctx && !uvif->off_chanctx) {
+			rcu_read_unlock();
+			return NULL;
+		}
 
-			if (!uvif->chanctx && !uvif->off_chanctx) {
+		if ((uvif->chanctx &&
+		     (uvif->chanctx->index != curr_chanctx_idx)) ||
+		    !uvif->chanctx) {
+			if ((uvif->off_chanctx &&
+			     (uvif->off_chanctx->index !=
+			      curr_chanctx_idx)) ||
+			    !uvif->off_chanctx) {
 				rcu_read_unlock();
-				continue;
-			}
-
-			if ((uvif->chanctx &&
-			     (uvif->chanctx->index != curr_chanctx_idx)) ||
-			    !uvif->chanctx) {
-				if ((uvif->off_chanctx &&
-				     (uvif->off_chanctx->index !=
-				      curr_chanctx_idx)) ||
-				    !uvif->off_chanctx) {
-					rcu_read_unlock();
-					continue;
-				} else {
-					curr_vif_op_chan =
-						UMAC_VIF_CHANCTX_TYPE_OFF;
-				}
+				return NULL;
 			} else {
-				if (dev->roc_params.roc_in_progress &&
-				    !dev->roc_params.need_offchan)
-					curr_vif_op_chan =
-						UMAC_VIF_CHANCTX_TYPE_OFF;
-				else
-					curr_vif_op_chan =
-						UMAC_VIF_CHANCTX_TYPE_OPER;
+				*op_chan = UMAC_VIF_CHANCTX_TYPE_OFF;
 			}
 		} else {
-			vif_index = (curr_peer_opp - MAX_PEERS);
+			if (dev->roc_params.roc_in_progress &&
+			    !dev->roc_params.need_offchan)
+				*op_chan = UMAC_VIF_CHANCTX_TYPE_OFF;
+			else
+				*op_chan = UMAC_VIF_CHANCTX_TYPE_OPER;
+		}
+	} else {
+		vif_index = (peer_id - MAX_PEERS);
 
-			vif = rcu_dereference(dev->vifs[vif_index]);
+		vif = rcu_dereference(dev->vifs[vif_index]);
 
-			if (!vif) {
-				rcu_read_unlock();
-				continue;
-			}
+		if (!vif) {
+			rcu_read_unlock();
+			return NULL;
+		}
 
-			uvif = (struct umac_vif *)(vif->drv_priv);
+		uvif = (struct umac_vif *)(vif->drv_priv);
 
-			if (!uvif->chanctx && !uvif->off_chanctx) {
-				rcu_read_unlock();
-				continue;
-			}
+		if (!uvif->chanctx && !uvif->off_chanctx) {
+			rcu_read_unlock();
+			return NULL;
+		}
 
-			/* For a beacon queue we will process the frames
-			 * irrespective of the current channel context.
-			 * The FW will take care of transmitting them in the
-			 * appropriate channel.
-			 */
+		/* For a beacon queue we will process the frames
+		 * irrespective of the current channel context.
+		 * The FW will take care of transmitting them in the
+		 * appropriate channel.
+		 */
 
-			if (ac != WLAN_AC_BCN &&
-			    ((uvif->chanctx &&
-			      (uvif->chanctx->index != curr_chanctx_idx)) ||
-			     !uvif->chanctx)) {
-				if ((uvif->off_chanctx &&
-				     (uvif->off_chanctx->index !=
-				      curr_chanctx_idx)) ||
-				    !uvif->off_chanctx) {
-					rcu_read_unlock();
-					continue;
-				} else {
-					curr_vif_op_chan =
-						UMAC_VIF_CHANCTX_TYPE_OFF;
-				}
+		if (ac != WLAN_AC_BCN &&
+		    ((uvif->chanctx &&
+		      (uvif->chanctx->index != curr_chanctx_idx)) ||
+		     !uvif->chanctx)) {
+			if ((uvif->off_chanctx &&
+			     (uvif->off_chanctx->index !=
+			      curr_chanctx_idx)) ||
+			    !uvif->off_chanctx) {
+				rcu_read_unlock();
+				return NULL;
 			} else {
-				if (dev->roc_params.roc_in_progress &&
-				    !dev->roc_params.need_offchan)
-					curr_vif_op_chan =
-						UMAC_VIF_CHANCTX_TYPE_OFF;
-				else
-					curr_vif_op_chan =
-						UMAC_VIF_CHANCTX_TYPE_OPER;
+				*op_chan = UMAC_VIF_CHANCTX_TYPE_OFF;
 			}
+		} else {
+			if (dev->roc_params.roc_in_progress &&
+			    !dev->roc_params.need_offchan)
+				*op_chan = UMAC_VIF_CHANCTX_TYPE_OFF;
+			else
+				*op_chan = UMAC_VIF_CHANCTX_TYPE_OPER;
 		}
+	}
 
-		rcu_read_unlock();
+	rcu_read_unlock();
 #endif
+
 #ifdef MULTI_CHAN_SUPPORT
-		pend_q = &tx->pending_pkt[curr_vif_op_chan][curr_peer_opp][ac];
+	return tx_pick_tid(dev, tx->pending_pkt[*op_chan][peer_id][ac],
+			   ac, peer_id, tid);
 #else
-		pend_q = &tx->pending_pkt[curr_peer_opp][ac];
+	return tx_pick_tid(dev, tx->pending_pkt[peer_id][ac],
+			   ac, peer_id, tid);
 #endif
-		pend_q_len = skb_queue_len(pend_q);
+}
 
-		if (pend_q_len) {
+
+static bool tx_peer_pend_empty(struct tx_config *tx,
+			       unsigned int peer_id,
+			       int ac)
+{
 #ifdef MULTI_CHAN_SUPPORT
-			tx->curr_peer_opp[curr_chanctx_idx][ac] =
-				(curr_peer_opp + 1) % MAX_PEND_Q_PER_AC;
+	int i;
+
+	for (i = 0; i < MAX_UMAC_VIF_CHANCTX_TYPES; i++)
+		if (tx_pend_q_len(tx->pending_pkt[i][peer_id][ac]))
+			return false;
+
+	return true;
 #else
-			tx->curr_peer_opp[ac] =
-				(curr_peer_opp + 1) % MAX_PEND_Q_PER_AC;
+	return !tx_pend_q_len(tx->pending_pkt[peer_id][ac]);
 #endif
+}
+
+
+/* Every candidate peer has been given a quantum this round and none can
+ * send yet. Give all of them the rounds it takes the closest one to get
+ * back to 0, less the one the next round gives, instead of looping over
+ * them round after round.
+ */
+static void tx_drr_skip_rounds(struct tx_config *tx,
+			       int ac,
+			       unsigned long candidates,
+			       int quantum)
+{
+	unsigned int peer_id;
+	int rounds = INT_MAX;
+
+	for_each_set_bit(peer_id, &candidates, MAX_PEND_Q_PER_AC)
+		rounds = min_t(int, rounds,
+			       DIV_ROUND_UP(-tx->deficit[peer_id][ac],
+					    quantum));
+
+	if (rounds <= 1)
+		return;
+
+	for_each_set_bit(peer_id, &candidates, MAX_PEND_Q_PER_AC)
+		tx->deficit[peer_id][ac] += (rounds - 1) * quantum;
+}
+
+
+/* Pick the peer to serve next on an AC. Only peers flagged in
+ * pend_q_active are visited, the flag is set when a frame is queued and
+ * cleared here once all the queues of the peer are empty.
+ *
+ * Peers are served in deficit round robin: a peer keeps the opportunity
+ * while its deficit is not negative, tx_drr_charge takes the bytes sent
+ * off it, or the airtime used with airtime_fair. A peer found with a
+ * negative deficit gets a quantum added and the next one is tried. Once
+ * a whole round finds no peer that can send, the rounds needed are
+ * credited in one step.
+ */
+struct curr_peer_info get_curr_peer_opp(struct mac80211_dev *dev,
+#ifdef MULTI_CHAN_SUPPORT
+					int curr_chanctx_idx,
+#endif
+					int ac)
+{
+	unsigned int curr_peer_opp = 0;
+	unsigned int curr_vif_op_chan = UMAC_VIF_CHANCTX_TYPE_OPER;
+	struct tx_config *tx = &dev->tx;
+	struct curr_peer_info peer_info;
+	unsigned int pend_q_len = 0;
+	struct sk_buff_head *pend_q = NULL;
+	unsigned long candidates = tx->pend_q_active[ac];
+	unsigned long owed = 0;
+	int quantum = dev->params->airtime_fair ? TX_AIRTIME_QUANTUM :
+						  TX_DRR_QUANTUM;
+	int tid = 0;
+
+#ifdef MULTI_CHAN_SUPPORT
+	curr_peer_opp = tx->curr_peer_opp[curr_chanctx_idx][ac];
+#else
+	curr_peer_opp = tx->curr_peer_opp[ac];
+#endif
+
+	while (candidates) {
+		curr_peer_opp = find_next_bit(&candidates,
+					      MAX_PEND_Q_PER_AC,
+					      curr_peer_opp);
+
+		if (curr_peer_opp >= MAX_PEND_Q_PER_AC)
+			curr_peer_opp = find_first_bit(&candidates,
+						       MAX_PEND_Q_PER_AC);
+
+		pend_q = tx_peer_pend_q(dev,
+#ifdef MULTI_CHAN_SUPPORT
+					curr_chanctx_idx,
+#endif
+					ac,
+					curr_peer_opp,
+					&curr_vif_op_chan,
+					&tid);
+
+		pend_q_len = pend_q ? skb_queue_len(pend_q) : 0;
+
+		if (!pend_q_len) {
+			if (tx_peer_pend_empty(tx, curr_peer_opp, ac)) {
+				clear_bit(curr_peer_opp,
+					  &tx->pend_q_active[ac]);
+				tx->deficit[curr_peer_opp][ac] = 0;
+			}
+
+			__clear_bit(curr_peer_opp, &candidates);
+			continue;
+		}
+
+		if (tx->deficit[curr_peer_opp][ac] >= 0)
 			break;
+
+		tx->deficit[curr_peer_opp][ac] += quantum;
+		__set_bit(curr_peer_opp, &owed);
+
+		if (owed == candidates) {
+			tx_drr_skip_rounds(tx, ac, candidates, quantum);
+			owed = 0;
 		}
+
+		curr_peer_opp = (curr_peer_opp + 1) % MAX_PEND_Q_PER_AC;
 	}
 
-	if (i == MAX_PEND_Q_PER_AC) {
+	if (!candidates) {
 		peer_info.id = -1;
 		peer_info.op_chan_idx = -1;
+		peer_info.tid = -1;
 	} else {
+#ifdef MULTI_CHAN_SUPPORT
+		tx->curr_peer_opp[curr_chanctx_idx][ac] = curr_peer_opp;
+#else
+		tx->curr_peer_opp[ac] = curr_peer_opp;
+#endif
+		tx->curr_tid[curr_peer_opp][ac] = tid;
 		peer_info.id = curr_peer_opp;
 		peer_info.op_chan_idx = curr_vif_op_chan;
+		peer_info.tid = tid;
 		UCCP_DEBUG_TX("%s: Queue: %d Peer: %d op_chan: %d ",
 			__func__,
 			ac,
@@ -563,6 +907,31 @@ struct curr_peer_info get_curr_peer_opp(struct mac80211_dev *dev,
 }
 
 
+/* Charge the bytes (or airtime) sent to the peer, once it runs out of
+ * deficit the opportunity moves on to the next active peer.
+ */
+static void tx_drr_charge(struct tx_config *tx,
+#ifdef MULTI_CHAN_SUPPORT
+			  int curr_chanctx_idx,
+#endif
+			  int ac,
+			  unsigned int peer_id,
+			  int cost)
+{
+	tx->deficit[peer_id][ac] -= cost;
+
+	if (tx->deficit[peer_id][ac] >= 0)
+		return;
+
+#ifdef MULTI_CHAN_SUPPORT
+	tx->curr_peer_opp[curr_chanctx_idx][ac] =
+		(peer_id + 1) % MAX_PEND_Q_PER_AC;
+#else
+	tx->curr_peer_opp[ac] = (peer_id + 1) % MAX_PEND_Q_PER_AC;
+#endif
+}
+
+
 #ifdef MULTI_CHAN_SUPPORT
 void uccp420wlan_tx_proc_send_pend_frms_all(struct mac80211_dev *dev,
 					    int ch_id)
@@ -673,7 +1042,9 @@ int uccp420wlan_tx_proc_pend_frms(struct mac80211_dev *dev,
 	unsigned int max_tx_cmds = dev->params->max_tx_cmds;
 	struct sk_buff_head *txq = NULL;
 	struct sk_buff_head *pend_pkt_q = NULL;
+	struct sk_buff_head *tid_q = NULL;
 	unsigned int total_pending_processed = 0;
+	int cost = 0;
 	int pend_pkt_q_len = 0;
 	struct curr_peer_info peer_info;
 	int loop_cnt = 0;
@@ -691,10 +1062,11 @@ int uccp420wlan_tx_proc_pend_frms(struct mac80211_dev *dev,
 		return 0;
 
 #ifdef MULTI_CHAN_SUPPORT
-	pend_pkt_q = &tx->pending_pkt[peer_info.op_chan_idx][peer_info.id][ac];
+	tid_q = tx->pending_pkt[peer_info.op_chan_idx][peer_info.id][ac];
 #else
-	pend_pkt_q = &tx->pending_pkt[peer_info.id][ac];
+	tid_q = tx->pending_pkt[peer_info.id][ac];
 #endif
+	pend_pkt_q = &tid_q[peer_info.tid];
 
 #ifdef MULTI_CHAN_SUPPORT
 	pkt_info = &dev->tx.pkt_info[curr_chanctx_idx][token_id];
@@ -728,9 +1100,7 @@ int uccp420wlan_tx_proc_pend_frms(struct mac80211_dev *dev,
 				max_tx_cmds = MAX_SUBFRAMES_IN_AMPDU_HT;
 		if (!check_80211_aggregation(dev,
 					     loop_skb,
-					     ac,
-					     peer_info.op_chan_idx,
-					     peer_info.id) ||
+					     pend_pkt_q) ||
 		    (skb_queue_len(txq) >= max_tx_cmds)) {
 			break;
 		}
@@ -747,7 +1117,34 @@ int uccp420wlan_tx_proc_pend_frms(struct mac80211_dev *dev,
 
 	total_pending_processed = skb_queue_len(txq);
 
-	pend_pkt_q_len = skb_queue_len(pend_pkt_q);
+	if (ac != WLAN_AC_BCN) {
+		dev->stats->tx_descs_sent++;
+		dev->stats->tx_desc_frames += total_pending_processed;
+	}
+
+	/* With airtime fairness the peer is charged an estimate now, the
+	 * difference to the airtime used is charged at TX done
+	 */
+	pkt_info->airtime_est = 0;
+
+	if (!dev->params->airtime_fair) {
+		skb_queue_walk(txq, loop_skb)
+			cost += loop_skb->len;
+	} else if (ac != WLAN_AC_BCN) {
+		pkt_info->airtime_est = tx_airtime_estimate(dev, txq);
+		cost = pkt_info->airtime_est;
+	}
+
+	if (cost)
+		tx_drr_charge(tx,
+#ifdef MULTI_CHAN_SUPPORT
+			      curr_chanctx_idx,
+#endif
+			      ac,
+			      peer_info.id,
+			      cost);
+
+	pend_pkt_q_len = tx_pend_q_len(tid_q);
 	if ((ac != WLAN_AC_BCN) &&
 	    (tx->queue_stopped_bmp & (1 << ac)) &&
 	    pend_pkt_q_len < (MAX_TX_QUEUE_LEN / 2)) {
@@ -775,18 +1172,19 @@ int uccp420wlan_tx_alloc_token(struct mac80211_dev *dev,
 			       int peer_id,
 			       struct sk_buff *skb)
 {
-	int token_id = NUM_TX_DESCS;
 	struct tx_config *tx = &dev->tx;
+	int token_id = NUM_TX_DESCS;
 	struct sk_buff_head *pend_pkt_q = NULL;
 	unsigned int pkts_pend = 0;
 	struct ieee80211_tx_info *tx_info;
 
 	spin_lock_bh(&tx->lock);
 #ifdef MULTI_CHAN_SUPPORT
-	pend_pkt_q = &tx->pending_pkt[off_chanctx_idx][peer_id][ac];
+	pend_pkt_q = &tx->pending_pkt[off_chanctx_idx][peer_id][ac]
+				     [tx_tid_slot(skb)];
 
 #else
-	pend_pkt_q = &tx->pending_pkt[peer_id][ac];
+	pend_pkt_q = &tx->pending_pkt[peer_id][ac][tx_tid_slot(skb)];
 #endif
 #ifdef MULTI_CHAN_SUPPORT
 	UCCP_DEBUG_TX("%s-UMACTX:Alloc Req q = %d off_chan: %d out_tok:%d\n",
@@ -802,6 +1200,7 @@ int uccp420wlan_tx_alloc_token(struct mac80211_dev *dev,
 
 	/* Queue the frame to the pending frames queue */
 	skb_queue_tail(pend_pkt_q, skb);
+	set_bit(peer_id, &tx->pend_q_active[ac]);
 
 	tx_info = IEEE80211_SKB_CB(skb);
 
@@ -810,9 +1209,7 @@ int uccp420wlan_tx_alloc_token(struct mac80211_dev *dev,
 
 		agg_status = check_80211_aggregation(dev,
 						     skb,
-						     ac,
-						     off_chanctx_idx,
-						     peer_id);
+						     pend_pkt_q);
 
 		if (agg_status || !dev->params->enable_early_agg_checks) {
 			int max_cmds = dev->params->max_tx_cmds;
@@ -838,7 +1235,13 @@ int uccp420wlan_tx_alloc_token(struct mac80211_dev *dev,
 	 * the shared ROC queue (which is VO right now), since this would block
 	 * ROC traffic too.
 	 */
-	if (skb_queue_len(pend_pkt_q) >= MAX_TX_QUEUE_LEN) {
+#ifdef MULTI_CHAN_SUPPORT
+	pkts_pend = tx_pend_q_len(tx->pending_pkt[off_chanctx_idx]
+						 [peer_id][ac]);
+#else
+	pkts_pend = tx_pend_q_len(tx->pending_pkt[peer_id][ac]);
+#endif
+	if (pkts_pend >= MAX_TX_QUEUE_LEN) {
 		if ((!dev->roc_params.roc_in_progress) ||
 		    (dev->roc_params.roc_in_progress &&
 		     (ac != UMAC_ROC_AC))) {
@@ -890,6 +1293,31 @@ out:
 }
 
 
+/* Frames pending in the queue the frames of a mac80211 TXQ land in: the
+ * channel context and TID slot picked by tx_frame and alloc_token
+ */
+unsigned int uccp420wlan_txq_pend_len(struct mac80211_dev *dev,
+				      struct ieee80211_txq *txq,
+				      int peer_id,
+				      int ac)
+{
+	int tid_slot = txq->sta ? (txq->tid & 1) : 0;
+#ifdef MULTI_CHAN_SUPPORT
+	struct umac_vif *uvif = (struct umac_vif *)txq->vif->drv_priv;
+	int chanctx_idx = UMAC_VIF_CHANCTX_TYPE_OPER;
+
+	if (uvif->chanctx &&
+	    uvif->chanctx->index == dev->roc_off_chanctx_idx)
+		chanctx_idx = UMAC_VIF_CHANCTX_TYPE_OFF;
+
+	return skb_queue_len(&dev->tx.pending_pkt[chanctx_idx][peer_id][ac]
+						 [tid_slot]);
+#else
+	return skb_queue_len(&dev->tx.pending_pkt[peer_id][ac][tid_slot]);
+#endif
+}
+
+
 #ifdef MULTI_CHAN_SUPPORT
 int get_band_chanctx(struct mac80211_dev *dev, struct umac_vif *uvif)
 {
@@ -935,6 +1363,8 @@ int uccp420wlan_tx_free_buff_req(struct mac80211_dev *dev,
 	struct tx_pkt_info *pkt_info = NULL;
 #endif
 	int start_ac, end_ac;
+	struct tx_pkt_info *done_info = NULL;
+	unsigned int airtime = 0, bytes = 0;
 
 	skb_queue_head_init(&tx_done_list);
 
@@ -984,6 +1414,32 @@ int uccp420wlan_tx_free_buff_req(struct mac80211_dev *dev,
 						skb_list);
 	}
 
+	/* Correct the airtime estimate before the next peer is picked */
+	if (skb_queue_len(&tx_done_list)) {
+#ifdef MULTI_CHAN_SUPPORT
+		done_info = &tx->pkt_info[chanctx_idx][desc_id];
+#else
+		done_info = &tx->pkt_info[desc_id];
+#endif
+		airtime = tx_airtime(tx_done, &tx_done_list,
+				     done_info->hdr_len, &bytes);
+		tx->airtime[done_info->peer_id] += airtime;
+		tx->tx_bytes[done_info->peer_id] += bytes;
+
+		if (dev->params->airtime_fair &&
+		    tx_done->queue != WLAN_AC_BCN)
+			tx_drr_charge(tx,
+#ifdef MULTI_CHAN_SUPPORT
+				      chanctx_idx,
+#endif
+				      tx_done->queue,
+				      done_info->peer_id,
+				      (int)airtime -
+				      (int)done_info->airtime_est);
+
+		done_info->airtime_est = 0;
+	}
+
 	/* Reserved token */
 	if (desc_id < (NUM_TX_DESCS_PER_AC * NUM_ACS)) {
 		start_ac = end_ac = tx_done->queue;
@@ -1016,8 +1472,10 @@ int uccp420wlan_tx_free_buff_req(struct mac80211_dev *dev,
 
 	/* Unmap here before release lock to avoid race */
 	if (skb_queue_len(&tx_done_list)) {
+		hal_ops.unmap_tx_desc(tx_done->descriptor_id,
+				      skb_queue_len(&tx_done_list));
+
 		skb_queue_walk_safe(&tx_done_list, skb, tmp) {
-			hal_ops.unmap_tx_buf(tx_done->descriptor_id, pkt);
 			UCCP_DEBUG_TX("%s-UMACTX:TXDONE: ID=%d",
 				dev->name,
 				tx_done->descriptor_id);
@@ -1222,7 +1680,6 @@ unsigned int uccp420wlan_proc_tx_dscrd_chsw(struct mac80211_dev *dev,
 	struct tx_config *tx = &dev->tx;
 	struct sk_buff_head *txq = NULL, tx_done_list;
 	int chanctx_idx = -1;
-	int pkt = 0;
 	int txq_len = 0;
 	struct sk_buff *skb = NULL;
 	struct sk_buff *skb_first = NULL;
@@ -1276,7 +1733,6 @@ unsigned int uccp420wlan_proc_tx_dscrd_chsw(struct mac80211_dev *dev,
 			__LINE__,
 			tx_done->retries_num[0],
 			tx_done->rate[0]);
-	pkt = 0;
 
 	skb_first = skb_peek(txq);
 
@@ -1303,12 +1759,12 @@ unsigned int uccp420wlan_proc_tx_dscrd_chsw(struct mac80211_dev *dev,
 	       (struct ieee80211_tx_info *)IEEE80211_SKB_CB(skb_first),
 	       sizeof(struct ieee80211_tx_info));
 
+	hal_ops.unmap_tx_desc(desc_id, txq_len);
+
 	skb_queue_walk_safe(txq, skb, tmp) {
 		if (!skb)
 			continue;
 
-		hal_ops.unmap_tx_buf(desc_id, pkt);
-
 		/* In the Tx path we move the .11hdr from skb to CMD_TX
 		 * Hence pushing it here
 		 */
@@ -1332,7 +1788,6 @@ unsigned int uccp420wlan_proc_tx_dscrd_chsw(struct mac80211_dev *dev,
 			UCCP_DEBUG_TX("CTX is right with retry bit set.\n");
 		mac_hdr->frame_control |= cpu_to_le16(IEEE80211_FCTL_RETRY);
 		}
-		pkt++;
 	}
 
 	/* First check if there is a packet in the txq of the current
@@ -1473,10 +1928,30 @@ static void print_persec_stats(unsigned long data)
 #endif
 
 
+static void uccp420wlan_tx_init_token_masks(struct tx_config *tx)
+{
+	unsigned int ac, i;
+
+	/* Tokens are allocated from buf_pool_bmp[0] */
+	BUILD_BUG_ON(NUM_TX_DESCS > BITS_PER_LONG);
+
+	for (ac = 0; ac < NUM_ACS; ac++) {
+		tx->ac_token_mask[ac] = 0;
+
+		for (i = 0; i < NUM_TX_DESCS_PER_AC; i++)
+			tx->ac_token_mask[ac] |= BIT(ac + (NUM_ACS * i));
+	}
+
+	tx->spare_token_mask = GENMASK(NUM_TX_DESCS - 1,
+				       NUM_ACS * NUM_TX_DESCS_PER_AC);
+}
+
+
 void uccp420wlan_tx_init(struct mac80211_dev *dev)
 {
 	int i = 0;
 	int j = 0;
+	int t = 0;
 #ifdef MULTI_CHAN_SUPPORT
 	int k = 0;
 #endif
@@ -1486,20 +1961,30 @@ void uccp420wlan_tx_init(struct mac80211_dev *dev)
 	       0,
 	       sizeof(long) * ((NUM_TX_DESCS/TX_DESC_BUCKET_BOUND) + 1));
 
+	uccp420wlan_tx_init_token_masks(tx);
+
 	tx->queue_stopped_bmp = 0;
-	tx->next_spare_token_ac = WLAN_AC_BE;
 
 	for (i = 0; i < NUM_ACS; i++) {
 		for (j = 0; j < MAX_PEND_Q_PER_AC; j++) {
+			for (t = 0; t < TX_TIDS_PER_AC; t++) {
 #ifdef MULTI_CHAN_SUPPORT
-			for (k = 0; k < MAX_UMAC_VIF_CHANCTX_TYPES; k++)
-				skb_queue_head_init(&tx->pending_pkt[k][j][i]);
+				for (k = 0; k < MAX_UMAC_VIF_CHANCTX_TYPES; k++)
+					skb_queue_head_init(
+						&tx->pending_pkt[k][j][i][t]);
 #else
-				skb_queue_head_init(&tx->pending_pkt[j][i]);
+				skb_queue_head_init(&tx->pending_pkt[j][i][t]);
 #endif
+			}
+
+			tx->curr_tid[j][i] = 0;
 		}
 
 		tx->outstanding_tokens[i] = 0;
+		tx->pend_q_active[i] = 0;
+
+		for (j = 0; j < MAX_PEND_Q_PER_AC; j++)
+			tx->deficit[j][i] = 0;
 	}
 
 	for (i = 0; i < NUM_TX_DESCS; i++) {
@@ -1542,6 +2027,7 @@ void uccp420wlan_tx_deinit(struct mac80211_dev *dev)
 {
 	int i = 0;
 	int j = 0;
+	int t = 0;
 #ifdef MULTI_CHAN_SUPPORT
 	int k = 0;
 #endif
@@ -1554,6 +2040,18 @@ void uccp420wlan_tx_deinit(struct mac80211_dev *dev)
 
 	ieee80211_stop_queues(dev->hw);
 
+	/* Frames left in the TXQs are purged by mac80211 */
+	spin_lock_bh(&tx->txq_lock);
+	for (i = 0; i < NUM_ACS; i++) {
+		struct umac_txq *utxq, *tmp;
+
+		list_for_each_entry_safe(utxq, tmp, &tx->txq_active[i], list) {
+			list_del_init(&utxq->list);
+			utxq->active = false;
+		}
+	}
+	spin_unlock_bh(&tx->txq_lock);
+
 	wait_for_tx_complete(tx);
 
 	spin_lock_bh(&tx->lock);
@@ -1579,15 +2077,23 @@ void uccp420wlan_tx_deinit(struct mac80211_dev *dev)
 
 	for (i = 0; i < NUM_ACS; i++) {
 		for (j = 0; j < MAX_PEND_Q_PER_AC; j++) {
+			for (t = 0; t < TX_TIDS_PER_AC; t++) {
 #ifdef MULTI_CHAN_SUPPORT
-			for (k = 0; k < MAX_UMAC_VIF_CHANCTX_TYPES; k++)
-				pend_q = &tx->pending_pkt[k][j][i];
+				for (k = 0; k < MAX_UMAC_VIF_CHANCTX_TYPES;
+				     k++) {
+					pend_q = &tx->pending_pkt[k][j][i][t];
+
+					while ((skb = skb_dequeue(pend_q)) !=
+					       NULL)
+						dev_kfree_skb_any(skb);
+				}
 #else
-			pend_q = &tx->pending_pkt[j][i];
-#endif
+				pend_q = &tx->pending_pkt[j][i][t];
 
-			while ((skb = skb_dequeue(pend_q)) != NULL)
-				dev_kfree_skb_any(skb);
+				while ((skb = skb_dequeue(pend_q)) != NULL)
+					dev_kfree_skb_any(skb);
+#endif
+			}
 		}
 	}
 
@@ -1760,18 +2266,17 @@ void uccp420wlan_proc_tx_complete(struct umac_event_tx_done *tx_done,
 	struct mac80211_dev *dev = (struct mac80211_dev *)context;
 	struct sk_buff *skb, *tmp;
 	struct sk_buff_head *tx_done_list;
-	unsigned int pkt = 0;
 
 	tx_done_list = &dev->tx.proc_tx_list[tx_done->descriptor_id];
 	dev->stats->tx_done_recv_count++;
 	update_aux_adc_voltage(dev, tx_done->pdout_voltage);
+	hal_ops.unmap_tx_desc(tx_done->descriptor_id,
+			      skb_queue_len(tx_done_list));
 	skb_queue_walk_safe(tx_done_list, skb, tmp) {
 		__skb_unlink(skb, tx_done_list);
 		if (!skb)
 			continue;
-		hal_ops.unmap_tx_buf(tx_done->descriptor_id, pkt);
 		dev_kfree_skb_any(skb);
-		pkt++;
 	}
 
 	/*send NEXT packet list*/
@@ -1980,14 +2485,14 @@ static int uccp420_flush_vif_all_pend_q(struct mac80211_dev *dev,
 				spin_lock_bh(&tx->lock);
 
 				pend_pkt_q =
-					&tx->pending_pkt[chanctx_type]
-							[pend_q]
-							[queue];
+					tx->pending_pkt[chanctx_type]
+						       [pend_q]
+						       [queue];
 
 				/* Assuming all packets for the peer have same
 				 * channel context
 				 */
-				pending = skb_queue_len(pend_pkt_q);
+				pending = tx_pend_q_len(pend_pkt_q);
 
 				spin_unlock_bh(&tx->lock);
 
@@ -2041,6 +2546,7 @@ int uccp420_discard_sta_pend_q(struct mac80211_dev *dev,
 	unsigned int pending = 0;
 	unsigned int queue = 0;
 	int pend_q = 0;
+	int tid;
 	struct sk_buff_head *pend_pkt_q = NULL, tx_discard_list;
 	struct tx_config *tx = &dev->tx;
 
@@ -2065,11 +2571,11 @@ int uccp420_discard_sta_pend_q(struct mac80211_dev *dev,
 			      pend_q);
 
 		pend_pkt_q =
-			&tx->pending_pkt[0]
-					[peer_id]
-					[queue];
+			tx->pending_pkt[0]
+				       [peer_id]
+				       [queue];
 
-		pending = skb_queue_len(pend_pkt_q);
+		pending = tx_pend_q_len(pend_pkt_q);
 
 		if (!pending)
 			continue;
@@ -2078,8 +2584,9 @@ int uccp420_discard_sta_pend_q(struct mac80211_dev *dev,
 			      __func__,
 			      __LINE__);
 
-		skb_queue_splice_tail_init(pend_pkt_q,
-					   &tx_discard_list);
+		for (tid = 0; tid < TX_TIDS_PER_AC; tid++)
+			skb_queue_splice_tail_init(&pend_pkt_q[tid],
+						   &tx_discard_list);
 		uccp420_purge_tx_queue(dev, &tx_discard_list);
 
 	}
@@ -2142,9 +2649,9 @@ int uccp420_discard_sta_tx_q(struct mac80211_dev *dev,
 					    loop_skb,
 					    tmp) {
 				skb_push(loop_skb, pkt_info->hdr_len);
-				hal_ops.unmap_tx_buf(i, pkt);
 				pkt++;
 			}
+			hal_ops.unmap_tx_desc(i, pkt);
 			uccp420_purge_tx_queue(dev, txq);
 			free_token(dev, i, pkt_info->queue);
 			dev->tx.desc_chan_map[i] = -1;
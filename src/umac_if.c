@@ -553,7 +553,7 @@ static int uccp420wlan_send_cmd(unsigned char *buf,
 		return -1;
 	}
 	dev = p->context;
-	nbuf = alloc_skb(len, GFP_ATOMIC);
+	nbuf = hal_ops.get_cmd_buf(len);
 
 	if (!nbuf) {
 		rcu_read_unlock();
@@ -748,9 +748,9 @@ int uccp420wlan_proc_tx(void)
 		return -90;
 	}
 
-	nbuf = alloc_skb(sizeof(struct cmd_tx_ctrl) +
-			 tx_cmd.num_frames_per_desc *
-			 MAX_GRAM_PAYLOAD_LEN, GFP_ATOMIC);
+	nbuf = hal_ops.get_cmd_buf(sizeof(struct cmd_tx_ctrl) +
+				   tx_cmd.num_frames_per_desc *
+				   MAX_GRAM_PAYLOAD_LEN);
 
 	data = skb_put(nbuf, sizeof(struct cmd_tx_ctrl));
 	memset(data, 0, sizeof(struct cmd_tx_ctrl));
@@ -775,7 +775,7 @@ int uccp420wlan_proc_tx(void)
 		if (hal_ops.map_tx_buf(descriptor_id, pkt,
 				       skb->data, skb->len)) {
 			rcu_read_unlock();
-			dev_kfree_skb_any(nbuf);
+			hal_ops.free_cmd_buf(nbuf);
 			return -30;
 		}
 		pkt++;
@@ -1459,9 +1459,8 @@ int uccp420wlan_prog_tx(unsigned int queue,
 			unsigned int descriptor_id,
 			bool retry)
 {
-	struct cmd_tx_ctrl tx_cmd;
-	struct sk_buff *nbuf, *nbuf_start;
-	unsigned char *data;
+	struct cmd_tx_ctrl *tx_cmd;
+	struct sk_buff *nbuf;
 	struct lmac_if_data *p;
 	struct mac80211_dev *dev;
 	struct umac_vif *uvif;
@@ -1476,8 +1475,7 @@ int uccp420wlan_prog_tx(unsigned int queue,
 	struct tx_config *tx;
 #endif
 	struct tx_pkt_info *pkt_info = NULL;
-
-	memset(&tx_cmd, 0, sizeof(struct cmd_tx_ctrl));
+	cycles_t start = get_cycles();
 
 	rcu_read_lock();
 	p = (struct lmac_if_data *)(rcu_dereference(lmac_if));
@@ -1508,6 +1506,23 @@ int uccp420wlan_prog_tx(unsigned int queue,
 
 	tx_info_first = IEEE80211_SKB_CB(skb_first);
 
+	/* The command is built in place in the command buffer, the 802.11
+	 * headers are copied once into their gram_payload slots.
+	 */
+	nbuf = hal_ops.get_cmd_buf(sizeof(struct cmd_tx_ctrl) +
+				   skb_queue_len(txq) *
+				   MAX_GRAM_PAYLOAD_LEN);
+
+	if (!nbuf) {
+		spin_unlock_bh(&dev->tx.lock);
+		rcu_read_unlock();
+		return -20;
+	}
+
+	tx_cmd = (struct cmd_tx_ctrl *)skb_put(nbuf,
+					       sizeof(struct cmd_tx_ctrl));
+	memset(tx_cmd, 0, sizeof(struct cmd_tx_ctrl));
+
 	mac_hdr = (struct ieee80211_hdr *)skb_first->data;
 	fc = mac_hdr->frame_control;
 	hdrlen = ieee80211_hdrlen(fc);
@@ -1527,7 +1542,7 @@ int uccp420wlan_prog_tx(unsigned int queue,
 			UCCP_DEBUG_IF("%s: hw_key is %s and iv_len: 0\n",
 			  __func__,
 			  tx_info_first->control.hw_key?"valid":"NULL");
-			tx_cmd.encrypt = ENCRYPT_DISABLE;
+			tx_cmd->encrypt = ENCRYPT_DISABLE;
 		 } else {
 			UCCP_DEBUG_IF("%s: cipher: %d, icv: %d",
 				  __func__,
@@ -1540,13 +1555,13 @@ int uccp420wlan_prog_tx(unsigned int queue,
 			 * the trailer include only iv_len
 			 */
 			hdrlen += tx_info_first->control.hw_key->iv_len;
-			tx_cmd.encrypt = ENCRYPT_ENABLE;
+			tx_cmd->encrypt = ENCRYPT_ENABLE;
 		}
 	}
 
 #ifdef MULTI_CHAN_SUPPORT
 	if (tx_info_first->flags & IEEE80211_TX_CTL_TX_OFFCHAN)
-		tx_cmd.tx_flags |= (1 << UMAC_TX_FLAG_OFFCHAN_FRM);
+		tx_cmd->tx_flags |= (1 << UMAC_TX_FLAG_OFFCHAN_FRM);
 #endif
 
 	/* For injected frames (wlantest) hw_key is not set,as PMF uses
@@ -1556,7 +1571,7 @@ int uccp420wlan_prog_tx(unsigned int queue,
 	if (ieee80211_is_unicast_robust_mgmt_frame(skb_first) &&
 	    ieee80211_has_protected(fc)) {
 		hdrlen += 8;
-		tx_cmd.encrypt = ENCRYPT_ENABLE;
+		tx_cmd->encrypt = ENCRYPT_ENABLE;
 	}
 
 	/* separate in to up to TSF and From TSF*/
@@ -1564,22 +1579,22 @@ int uccp420wlan_prog_tx(unsigned int queue,
 		hdrlen += 8; /* Timestamp*/
 
 	/* HAL UMAC-LMAC HDR*/
-	tx_cmd.hdr.id = UMAC_CMD_TX;
+	tx_cmd->hdr.id = UMAC_CMD_TX;
 	/* Keep the queue num and pool id in descriptor id */
-	tx_cmd.hdr.descriptor_id = 0;
-	tx_cmd.hdr.descriptor_id |= ((queue & 0x0000FFFF) << 16);
-	tx_cmd.hdr.descriptor_id |= (descriptor_id & 0x0000FFFF);
+	tx_cmd->hdr.descriptor_id = 0;
+	tx_cmd->hdr.descriptor_id |= ((queue & 0x0000FFFF) << 16);
+	tx_cmd->hdr.descriptor_id |= (descriptor_id & 0x0000FFFF);
 	/* Not used anywhere currently */
-	tx_cmd.hdr.length = sizeof(struct cmd_tx_ctrl);
+	tx_cmd->hdr.length = sizeof(struct cmd_tx_ctrl);
 
 	/* UMAC_CMD_TX*/
-	tx_cmd.if_index = vif_index;
-	tx_cmd.queue_num = queue;
-	tx_cmd.more_frms = more_frms;
-	tx_cmd.descriptor_id = descriptor_id;
-	tx_cmd.num_frames_per_desc = skb_queue_len(txq);
-	tx_cmd.pkt_gram_payload_len = hdrlen;
-	tx_cmd.aggregate_mpdu = AMPDU_AGGR_DISABLED;
+	tx_cmd->if_index = vif_index;
+	tx_cmd->queue_num = queue;
+	tx_cmd->more_frms = more_frms;
+	tx_cmd->descriptor_id = descriptor_id;
+	tx_cmd->num_frames_per_desc = skb_queue_len(txq);
+	tx_cmd->pkt_gram_payload_len = hdrlen;
+	tx_cmd->aggregate_mpdu = AMPDU_AGGR_DISABLED;
 
 #ifdef MULTI_CHAN_SUPPORT
 	dev->tx.pkt_info[curr_chanctx_idx][descriptor_id].vif_index = vif_index;
@@ -1591,58 +1606,42 @@ int uccp420wlan_prog_tx(unsigned int queue,
 
 	uvif = (struct umac_vif *) (tx_info_first->control.vif->drv_priv);
 
-	nbuf = alloc_skb(sizeof(struct cmd_tx_ctrl) +
-			 tx_cmd.num_frames_per_desc *
-			 MAX_GRAM_PAYLOAD_LEN, GFP_ATOMIC);
-
-	if (!nbuf) {
-		spin_unlock_bh(&dev->tx.lock);
-		rcu_read_unlock();
-		return -20;
-	}
-
 	/* Get the rate for first packet as all packets have same rate */
 	get_rate(skb_first,
-		 &tx_cmd,
+		 tx_cmd,
 		 pkt_info,
 		 retry,
 		 dev);
 
-	data = skb_put(nbuf, sizeof(struct cmd_tx_ctrl));
-	memset(data, 0, sizeof(struct cmd_tx_ctrl));
-	/*store the start for later use*/
-	nbuf_start = (struct sk_buff *)data;
-	memcpy(data, &tx_cmd,  sizeof(struct cmd_tx_ctrl));
-
 	UCCP_DEBUG_TX("%s-UMACTX: TX Frame, Queue = %d, descriptord_id = %d\n",
 		     dev->name,
-		     tx_cmd.queue_num, tx_cmd.descriptor_id);
+		     tx_cmd->queue_num, tx_cmd->descriptor_id);
 	UCCP_DEBUG_TX("		num_frames= %d qlen: %d len = %d\n",
-		     tx_cmd.num_frames_per_desc, skb_queue_len(txq),
+		     tx_cmd->num_frames_per_desc, skb_queue_len(txq),
 		     nbuf->len);
 
 	UCCP_DEBUG_TX("%s-UMACTX: Num rates = %d, %x, %x, %x, %x\n",
 		     dev->name,
-		     tx_cmd.num_rates,
-		     tx_cmd.rate[0],
-		     tx_cmd.rate[1],
-		     tx_cmd.rate[2],
-		     tx_cmd.rate[3]);
+		     tx_cmd->num_rates,
+		     tx_cmd->rate[0],
+		     tx_cmd->rate[1],
+		     tx_cmd->rate[2],
+		     tx_cmd->rate[3]);
 
 	UCCP_DEBUG_TX("%s-UMACTX: Retries   = %d, %d, %d, %d, %d\n",
 		  dev->name,
 		  pkt_info->max_retries,
-		  tx_cmd.rate_retries[0],
-		  tx_cmd.rate_retries[1],
-		  tx_cmd.rate_retries[2],
-		  tx_cmd.rate_retries[3]);
+		  tx_cmd->rate_retries[0],
+		  tx_cmd->rate_retries[1],
+		  tx_cmd->rate_retries[2],
+		  tx_cmd->rate_retries[3]);
 
 #ifdef MULTI_CHAN_SUPPORT
 	tx->desc_chan_map[descriptor_id] = curr_chanctx_idx;
 #endif
 
 	skb_queue_walk_safe(txq, skb, tmp) {
-		if (!skb || (pkt > tx_cmd.num_frames_per_desc))
+		if (!skb || (pkt > tx_cmd->num_frames_per_desc))
 			break;
 
 		mac_hdr = (struct ieee80211_hdr *)skb->data;
@@ -1671,31 +1670,33 @@ int uccp420wlan_prog_tx(unsigned int queue,
 #endif
 
 		/* Complete packet length */
-		((struct cmd_tx_ctrl *)nbuf_start)->pkt_length[pkt] = skb->len;
+		tx_cmd->pkt_length[pkt] = skb->len;
 
 		/* We move the 11hdr from skb to UMAC_CMD_TX, this is part of
 		 * online DMA changes, HW expects only data portion
 		 * While DMA. Not requried for loopback
 		 */
-		skb_put(nbuf, MAX_GRAM_PAYLOAD_LEN);
-
-		memcpy((unsigned char *)nbuf_start +
-			sizeof(struct cmd_tx_ctrl)+
-			(pkt * MAX_GRAM_PAYLOAD_LEN),
-			mac_hdr, hdrlen);
+		memcpy(skb_put(nbuf, MAX_GRAM_PAYLOAD_LEN), mac_hdr, hdrlen);
 
 		skb_pull(skb, hdrlen);
-		if (hal_ops.map_tx_buf(descriptor_id, pkt,
-				       skb->data, skb->len)) {
-			spin_unlock_bh(&dev->tx.lock);
-			rcu_read_unlock();
-			dev_kfree_skb_any(nbuf);
-			return -30;
-		}
 
 		pkt++;
 	}
 
+	/* Map all frames of the descriptor in one go */
+	if (hal_ops.map_tx_desc(descriptor_id, txq)) {
+		spin_unlock_bh(&dev->tx.lock);
+		rcu_read_unlock();
+		hal_ops.free_cmd_buf(nbuf);
+		return -30;
+	}
+
+	/* Cost of building an A-MPDU command, including the buffer mapping */
+	if (pkt > 1) {
+		dev->stats->tx_ampdu_build_cycles += get_cycles() - start;
+		dev->stats->tx_ampdu_builds++;
+	}
+
 #ifdef PERF_PROFILING
 	if (dev->params->driver_tput == 0) {
 #endif
@@ -2223,6 +2224,90 @@ int uccp420wlan_prog_tx_deinit(int vif_index, char *peer_addr)
 				    UMAC_CMD_TX_DEINIT);
 }
 
+static void uccp420wlan_tx_done_event(struct lmac_if_data *p, void *buff)
+{
+	struct mac80211_dev *dev = (struct mac80211_dev *)p->context;
+	int ac;
+#ifdef MULTI_CHAN_SUPPORT
+	int curr_chanctx_idx = -1;
+#endif
+
+	if (dev->params->production_test &&
+	    dev->params->start_prod_mode)
+		uccp420wlan_proc_tx_complete(buff, p->context);
+	else {
+		/* Increment tx_done_recv_count to keep track of number
+		 * of tx_done received do not count tx dones from host.
+		 */
+		dev->stats->tx_done_recv_count++;
+
+#ifdef MULTI_CHAN_SUPPORT
+		spin_lock(&dev->chanctx_lock);
+		curr_chanctx_idx = dev->curr_chanctx_idx;
+		spin_unlock(&dev->chanctx_lock);
+#endif
+		uccp420wlan_tx_complete(buff,
+#ifdef MULTI_CHAN_SUPPORT
+					curr_chanctx_idx,
+#endif
+					p->context);
+
+		/* Refill the pending queues from mac80211 now that
+		 * the token is back, not from tx_complete itself as
+		 * that is also called when a frame fails to be sent
+		 */
+		for (ac = WLAN_AC_VO; ac >= WLAN_AC_BK; ac--)
+			uccp420wlan_txq_pull(dev, ac);
+	}
+
+	cmd_info.tx_done_recv_count++;
+}
+
+
+/* Called by the HAL on each RX buffer and LMAC event before an skb is
+ * taken for it. In production test mode the data frames are only
+ * counted, TX done events are handled in place.
+ */
+static int uccp420wlan_rx_filter(void *buff, unsigned int len)
+{
+	struct host_mac_msg_hdr *hdr = (struct host_mac_msg_hdr *)buff;
+	struct lmac_if_data *p;
+	struct mac80211_dev *dev;
+	unsigned int event;
+	int verdict = HAL_RX_PASS;
+
+	if (len < sizeof(struct host_mac_msg_hdr))
+		return HAL_RX_PASS;
+
+	event = hdr->id & 0xffff;
+
+	if (event != UMAC_EVENT_RX &&
+	    (event != UMAC_EVENT_TX_DONE ||
+	     len < sizeof(struct umac_event_tx_done)))
+		return HAL_RX_PASS;
+
+	rcu_read_lock();
+
+	p = (struct lmac_if_data *)(rcu_dereference(lmac_if));
+
+	if (p) {
+		dev = (struct mac80211_dev *)p->context;
+
+		if (event == UMAC_EVENT_TX_DONE) {
+			uccp420wlan_tx_done_event(p, buff);
+			verdict = HAL_RX_DROP;
+		} else if (dev->params->production_test) {
+			dev->stats->rx_packet_data_count++;
+			verdict = HAL_RX_DROP;
+		}
+	}
+
+	rcu_read_unlock();
+
+	return verdict;
+}
+
+
 int uccp420wlan_msg_handler(void *nbuff,
 			    unsigned char sender_id)
 {
@@ -2233,9 +2318,6 @@ int uccp420wlan_msg_handler(void *nbuff,
 	struct sk_buff *skb = (struct sk_buff *)nbuff;
 	struct sk_buff *pending_cmd;
 	struct mac80211_dev *dev;
-#ifdef MULTI_CHAN_SUPPORT
-	int curr_chanctx_idx = -1;
-#endif
 
 	rcu_read_lock();
 
@@ -2261,6 +2343,8 @@ int uccp420wlan_msg_handler(void *nbuff,
 				(struct host_event_reset_complete *)buff;
 
 		uccp420wlan_reset_complete(r->version, p->context);
+		hal_ops.request_rings(r->cap & UMAC_CAP_EVENT_RING,
+				      r->cap & UMAC_CAP_CMD_RING);
 		spin_lock_bh(&cmd_info.control_path_lock);
 
 		if (cmd_info.outstanding_ctrl_req == 0) {
@@ -2311,29 +2395,7 @@ int uccp420wlan_msg_handler(void *nbuff,
 		}
 
 	} else if (event == UMAC_EVENT_TX_DONE) {
-		if (dev->params->production_test &&
-		    dev->params->start_prod_mode)
-			uccp420wlan_proc_tx_complete((void *)buff,
-						     p->context);
-		else {
-			/* Increment tx_done_recv_count to keep track of number
-			 * of tx_done received do not count tx dones from host.
-			 */
-			dev->stats->tx_done_recv_count++;
-
-#ifdef MULTI_CHAN_SUPPORT
-			spin_lock(&dev->chanctx_lock);
-			curr_chanctx_idx = dev->curr_chanctx_idx;
-			spin_unlock(&dev->chanctx_lock);
-#endif
-			uccp420wlan_tx_complete((void *)buff,
-#ifdef MULTI_CHAN_SUPPORT
-						curr_chanctx_idx,
-#endif
-						p->context);
-		}
-
-		cmd_info.tx_done_recv_count++;
+		uccp420wlan_tx_done_event(p, buff);
 	} else if (event == UMAC_EVENT_DISCONNECTED) {
 		struct host_event_disconnect *dis =
 			(struct host_event_disconnect *)buff;
@@ -2482,6 +2544,7 @@ int uccp420wlan_lmac_if_init(void *context, const char *name)
 	p->name = (char *)name;
 	p->context = context;
 	hal_ops.register_callback(uccp420wlan_msg_handler, UMAC_MOD_ID);
+	hal_ops.register_rx_filter(uccp420wlan_rx_filter);
 	rcu_assign_pointer(lmac_if, p);
 	skb_queue_head_init(&cmd_info.outstanding_cmd);
 	spin_lock_init(&cmd_info.control_path_lock);
@@ -2497,6 +2560,7 @@ void uccp420wlan_lmac_if_deinit(void)
 
 	UCCP_DEBUG_IF("%s-UMACIF: Deinit called\n", lmac_if->name);
 
+	hal_ops.register_rx_filter(NULL);
 	p = rcu_dereference(lmac_if);
 	rcu_assign_pointer(lmac_if, NULL);
 	synchronize_rcu();
@@ -2513,7 +2577,7 @@ void uccp420_lmac_if_free_outstnding(void)
 	 * anymore commands to the FW except RESET.
 	 */
 	while ((skb = __skb_dequeue(&cmd_info.outstanding_cmd)))
-		dev_kfree_skb_any(skb);
+		hal_ops.free_cmd_buf(skb);
 
 	cmd_info.outstanding_ctrl_req = 0;
 }